@@ -5,3 +5,24 @@
 -T fifo_queue_t
 -T hal_ln_tx_done_cb
 -T lnpacket_t
+-T ln_route_entry_t
+-T route_off_t
+-T input_t
+-T dup_t
+-T ln_rx_dup_stat_t
+-T hal_ln_talker_t
+-T hal_ln_cycles_t
+-T cycles_t
+-T trace_t
+-T hal_ln_frag_t
+-T hal_ln_xfer_t
+-T hal_ln_rx_ring_t
+-T direct_t
+-T hal_ln_stat_t
+-T hal_ln_queues_t
+-T ln_stat_cb_t
+-T lnpacket_prog_t
+-T ln_prog_result_t
+-T ln_prog_cb_t
+-T prog_state_t
+-T prog_op_t
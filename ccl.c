@@ -11,10 +11,25 @@
 #include <avr/io.h>
 #include "ccl.h"
 #include "hal_ln.h"
+#include "timing.h"
 
 
+#ifdef LNBACKOFF
+uint16_t        ccl_lfsr;
+#endif
+
 void ccl_init(void)
 {
+#ifdef LNBACKOFF
+    // Seed pseudo-random generator from device serial number
+    const volatile uint8_t *sernum = &SIGROW.SERNUM0;
+
+    for (uint8_t i = 0; i < 16; i++)
+        ccl_lfsr = (ccl_lfsr << 3 | ccl_lfsr >> 13) ^ sernum[i];
+    if (!ccl_lfsr)
+        ccl_lfsr = 1;
+#endif
+
     // Event channels setup
     // Ch0 UART 0 XDIR (PA4)
     EVSYS.CHANNEL0 = EVSYS_CHANNEL0_PORTA_PIN4_gc;
@@ -44,13 +59,13 @@ void ccl_init(void)
     // Timer setup
     // TCB0 timeout check (delay) of LUT0 output
     TCB0.CTRLB = TCB_CNTMODE_TIMEOUT_gc;
-    TCB0.CCMP = F_CPU * 15 / 1000000UL; // 15 s (1/4 bit)
+    TCB0.CCMP = TCB0_CCMP_VAL;   // 15 s (1/4 bit)
     TCB0.EVCTRL = TCB_CAPTEI_bm;
     TCB0.CTRLA = TCB_CLKSEL_DIV1_gc | TCB_ENABLE_bm;
 
     // TCB1 single-shot ASYNC
     TCB1.CTRLB = TCB_ASYNC_bm | TCB_CNTMODE_SINGLE_gc;
-    TCB1.CCMP = (F_CPU * 60 / 1000000UL) * 15;  // 60 s * 15 bits
+    TCB1.CCMP = TCB1_CCMP_VAL;   // 60 s * 15 bits
     TCB1.EVCTRL = TCB_CAPTEI_bm;
     TCB1.CTRLA = TCB_CLKSEL_DIV1_gc | TCB_ENABLE_bm;
 
@@ -62,7 +77,7 @@ void ccl_init(void)
     TCA0.SINGLE.CTRLECLR = TCA_SINGLE_DIR_bm;   // Count up
     TCA0.SINGLE.EVCTRL = 0;     // No event input
     TCA0.SINGLE.INTCTRL = 0;    // No interrupts
-    TCA0.SINGLE.PER = F_CPU * CD_TICK_TIME / 1000000UL - 1;
+    TCA0.SINGLE.PER = TCA0_PER_VAL;
     TCA0.SINGLE.CTRLA = TCA_SINGLE_CLKSEL_DIV1_gc | TCA_SINGLE_ENABLE_bm;
 
     // TCB2 CD backoff check
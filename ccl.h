@@ -47,15 +47,27 @@ static inline void ccl_collision_clear(void)
     TCB0.INTFLAGS = TCB_CAPT_bm;
 }
 
+#ifdef LNBACKOFF
+extern uint16_t ccl_lfsr;
+#endif
+
 /**
  * Get pseudo-random number.
  *
- * Well not random at all, but good enough if only a few LSB's are used.
+ * Without LNBACKOFF: Well not random at all, but good enough if only a few
+ * LSB's are used.
+ * With LNBACKOFF: 16 bit LFSR, seeded from the device serial number, so
+ * nodes started at the same time get different sequences.
  */
 __attribute__((always_inline))
 static inline uint16_t ccl_rnd(void)
 {
+#ifdef LNBACKOFF
+    ccl_lfsr = (ccl_lfsr >> 1) ^ (-(ccl_lfsr & 1) & 0xb400);
+    return ccl_lfsr;
+#else
     return TCA0.SINGLE.CNT;
+#endif
 }
 
 /**
@@ -5,11 +5,6 @@
  *  Author: Mikael Ejberg Pedersen
  */
 
-/*
- * Make sure _delay_us rounds down, not up.
- */
-#define __DELAY_ROUND_DOWN__ 1
-
 #include <avr/interrupt.h>
 #include <avr/io.h>
 #include <avr/pgmspace.h>
@@ -18,16 +13,16 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <avr/sleep.h>
 #include <util/atomic.h>
-#include <util/delay.h>
 #include "ac.h"
 #include "ccl.h"
 #include "fifo.h"
 #include "hal_ln.h"
 #include "ln_def.h"
-
-#define BAUDRATE    16667UL
-#define BAUD_REG    ((64 * F_CPU + 8 * BAUDRATE) / (16 * BAUDRATE))
+#include "rtc.h"
+#include "timing.h"
 
 
 /************************************************************************/
@@ -35,23 +30,221 @@
 /************************************************************************/
 
 #ifdef LNSTAT
+typedef hal_ln_stat_t stat_t;
+
+static stat_t   stat;
+#endif
+
+
+/************************************************************************/
+/* Cycle profiling                                                      */
+/************************************************************************/
+
+/**
+ * Free running timer used for cycle counting and trace time stamps.
+ */
+#if defined(LNCYCLES) || defined(LNTRACE)
+#ifndef LNCYCLES_TCB
+#define LNCYCLES_TCB    TCB3
+#endif
+#endif
+
+#ifdef LNCYCLES
+
+/**
+ * Max cycles for each interrupt. Defaults to one LocoNet bit time.
+ */
+#ifndef LNCYCLES_BUDGET_ISR
+#define LNCYCLES_BUDGET_ISR (F_CPU / BAUDRATE)
+#endif
+
+/**
+ * Max cycles for each API call. Defaults to 0 (not checked).
+ */
+#ifndef LNCYCLES_BUDGET_API
+#define LNCYCLES_BUDGET_API 0
+#endif
+
 typedef struct
 {
-    uint8_t         tx_max_attempts;
-    uint16_t        tx_total;
-    uint16_t        tx_success;
-    uint16_t        tx_fail;
-    uint16_t        tx_collisions;
-    uint16_t        rx_success;
-    uint16_t        rx_success_large;
-    uint16_t        rx_checksum;
-    uint16_t        rx_partial;
-    uint16_t        rx_extradata;
-    uint16_t        rx_collisions;
-    uint16_t        rx_nomem;
-} stat_t;
+    uint16_t        max;
+    uint16_t        cnt;
+    uint32_t        sum;
+} cycles_t;
 
-static stat_t   stat;
+static cycles_t cycles[HAL_LN_CYC_CNT];
+
+/*
+ * Cycles spent in measured interrupts, subtracted from API call measurements.
+ */
+static volatile uint16_t cycles_isr;
+
+static void cycles_add(uint8_t id, uint16_t cyc)
+{
+    cycles_t       *c = &cycles[id];
+
+    if (cyc > c->max)
+        c->max = cyc;
+    if (c->cnt == 0xffff)
+    {
+        c->cnt >>= 1;
+        c->sum >>= 1;
+    }
+    c->cnt++;
+    c->sum += cyc;
+}
+
+#define CYCLES_ISR_START()      uint16_t cyc_start = LNCYCLES_TCB.CNT
+#define CYCLES_ISR_END(id)      do { uint16_t cyc = LNCYCLES_TCB.CNT - cyc_start; \
+                                     cycles_isr += cyc; cycles_add(id, cyc); } while (0)
+#define CYCLES_API_START()      uint16_t cyc_start, cyc_isr; \
+                                ATOMIC_BLOCK(ATOMIC_RESTORESTATE) \
+                                    { cyc_start = LNCYCLES_TCB.CNT; cyc_isr = cycles_isr; }
+#define CYCLES_API_END(id)      ATOMIC_BLOCK(ATOMIC_RESTORESTATE) \
+                                    cycles_add(id, LNCYCLES_TCB.CNT - cyc_start - (cycles_isr - cyc_isr))
+
+static uint16_t cycles_budget(uint8_t id)
+{
+    return id < HAL_LN_CYC_SEND ? LNCYCLES_BUDGET_ISR : LNCYCLES_BUDGET_API;
+}
+
+void hal_ln_cycles(uint8_t id, hal_ln_cycles_t *c)
+{
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+    {
+        c->max = cycles[id].max;
+        c->avg = cycles[id].cnt ? cycles[id].sum / cycles[id].cnt : 0;
+        c->cnt = cycles[id].cnt;
+    }
+    c->budget = cycles_budget(id);
+}
+
+uint8_t hal_ln_cycles_check(void)
+{
+    uint8_t         fail = 0;
+    hal_ln_cycles_t c;
+
+    for (uint8_t id = 0; id < HAL_LN_CYC_CNT; id++)
+    {
+        hal_ln_cycles(id, &c);
+        if (c.budget && c.max > c.budget)
+            fail++;
+    }
+
+    return fail;
+}
+
+void hal_ln_cycles_reset(void)
+{
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+    {
+        memset(cycles, 0, sizeof(cycles));
+    }
+}
+
+static uint16_t cyc_ext_start;
+static uint16_t cyc_ext_isr;
+
+void hal_ln_cycles_begin(void)
+{
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+    {
+        cyc_ext_start = LNCYCLES_TCB.CNT;
+        cyc_ext_isr = cycles_isr;
+    }
+}
+
+void hal_ln_cycles_end(uint8_t id)
+{
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+    {
+        cycles_add(id, LNCYCLES_TCB.CNT - cyc_ext_start - (cycles_isr - cyc_ext_isr));
+    }
+}
+
+#else
+#define CYCLES_ISR_START()
+#define CYCLES_ISR_END(id)
+#define CYCLES_API_START()
+#define CYCLES_API_END(id)
+#endif
+
+
+/************************************************************************/
+/* Trace                                                                */
+/************************************************************************/
+
+#ifdef LNTRACE
+
+/**
+ * Number of trace records. Must be a power of 2, max 256.
+ */
+#ifndef LNTRACE_CNT
+#define LNTRACE_CNT     64
+#endif
+
+_Static_assert(LNTRACE_CNT && LNTRACE_CNT <= 256 && !(LNTRACE_CNT & (LNTRACE_CNT - 1)), "LNTRACE_CNT must be a power of 2, max 256");
+
+/*
+ * Trace events. Keep in sync with tools/lntrace.py
+ */
+enum
+{
+    TR_TX_START = 1,            // arg: attempt
+    TR_TX_BUSY,                 // arg: 0
+    TR_TX_ARM,                  // arg: CD BACKOFF / 20 us
+    TR_TX_END,                  // arg: 0=ok, 1=retry, 2=fail, 3=stalled
+    TR_RX_OP,                   // arg: opcode
+    TR_RX_END,                  // arg: 0=ok, 1=checksum, 2=too large, 3=no memory
+    TR_RX_FERR,                 // arg: data
+    TR_Q_TX,                    // arg: opcode
+    TR_Q_DONE,                  // arg: opcode
+    TR_Q_RX,                    // arg: opcode
+    TR_SCHED,                   // arg: 0
+    TR_DONE_CB                  // arg: result
+};
+
+typedef struct
+{
+    uint8_t         ev;
+    uint8_t         arg;
+    uint16_t        tick;       // RTC
+    uint16_t        cyc;        // LNCYCLES_TCB
+} trace_t;
+
+static trace_t  trace_buf[LNTRACE_CNT];
+static uint8_t  trace_idx;
+static bool     trace_stop;
+
+__attribute__((always_inline))
+static inline void trace(uint8_t ev, uint8_t arg)
+{
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+    {
+#ifdef LNTRACE_VPORT
+        LNTRACE_VPORT.IN = LNTRACE_bm;  // Toggle pin
+#endif
+        if (!trace_stop)
+        {
+            trace_t        *t = &trace_buf[trace_idx++ & (LNTRACE_CNT - 1)];
+
+            t->ev = ev;
+            t->arg = arg;
+            t->tick = RTC.CNT;
+            t->cyc = LNCYCLES_TCB.CNT;
+        }
+    }
+}
+
+#define TRACE(ev, arg)  trace(ev, arg)
+
+void hal_ln_trace_stop(bool stop)
+{
+    trace_stop = stop;
+}
+
+#else
+#define TRACE(ev, arg)
 #endif
 
 
@@ -66,45 +259,208 @@ static stat_t   stat;
 #define LNPACKET_CNT    8
 #endif
 
+/**
+ * Number of LocoNet packets reserved for reception.
+ * hal_ln_packet_get will not hand out the last free packets.
+ */
+#ifndef LNPACKET_RX_RESERVE
+#define LNPACKET_RX_RESERVE 0
+#endif
+
+/**
+ * Max number of received LocoNet packets waiting in rx queue.
+ */
+#ifndef LNPACKET_RX_MAX
+#define LNPACKET_RX_MAX LNPACKET_CNT
+#endif
+
+#if LNPACKET_RX_RESERVE >= LNPACKET_CNT
+#error "LNPACKET_RX_RESERVE must be less than LNPACKET_CNT"
+#endif
+
 /**
  * Packet structure for LocoNet and housekeeping data.
  */
-typedef struct
+typedef struct packet_t_
 {
     fifo_t          fifo;       // Fifo data
     hal_ln_tx_done_cb_t *cb;    // Callback function pointer
     void           *ctx;        // Callback context pointer
+    struct packet_t_ *grp;      // Next packet in send group (NULL if last)
+    struct packet_t_ *sched;    // Next packet in schedule list
+    uint16_t        time;       // Scheduled tx time
+    uint16_t        period;     // Period for periodic tx (0 if not periodic)
     hal_ln_result_t res;        // Result code
+    const hal_ln_xfer_t *xfer;  // Zero-copy data (NULL if data is in lndata)
     lnpacket_t      lndata;     // LocoNet data
 } packet_t;
 
+/*
+ * Zero-copy transfers use the private part of hal_ln_xfer_t as packet,
+ * without lndata.
+ */
+_Static_assert(offsetof(packet_t, lndata) <= HAL_LN_XFER_PRIV, "HAL_LN_XFER_PRIV too small");
+
+#define PACKET_FROM_XFER(x) ((packet_t *)(x)->priv)
+
 #define PACKET_FROM_FIFO(x) ((packet_t *)((uint8_t *)(x) - offsetof(packet_t, fifo)))
 #define PACKET_FROM_LN(x) ((packet_t *)((uint8_t *)(x) - offsetof(packet_t, lndata)))
 
 static packet_t packets[LNPACKET_CNT];
 
+/*
+ * Opcode of packet.
+ */
+static inline uint8_t packet_op(const packet_t *packet)
+{
+    if (packet->xfer)
+        return (packet->xfer->cnt && packet->xfer->frag[0].len) ? packet->xfer->frag[0].data[0] : 0;
+    return packet->lndata.hdr.op;
+}
+
 static fifo_queue_t queue_free = { NULL, NULL };
 static fifo_queue_t queue_rx = { NULL, NULL };
 static fifo_queue_t queue_tx = { NULL, NULL };
 static fifo_queue_t queue_done = { NULL, NULL };
 
+static uint8_t  free_cnt;       // Packets in free queue
+static uint8_t  rx_cnt;         // Packets in rx queue
 
-lnpacket_t     *hal_ln_packet_get(void)
+static volatile uint8_t pending = 0;    // Pending work (HAL_LN_EV_xxx)
+
+/*
+ * Rx scratch buffer, owned by rx interrupt.
+ * Used when no packet is available. A packet received here is moved to
+ * the first packet that becomes free.
+ */
+static lnpacket_t rx_scratch;
+static volatile bool rx_scratch_full = false;
+
+
+/*
+ * Flag pending work.
+ */
+__attribute__((always_inline))
+static inline void pending_set(uint8_t ev)
 {
-    fifo_t         *p;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+    {
+        pending |= ev;
+    }
+}
+
+/*
+ * Put packet in tx queue.
+ */
+static void queue_put_tx(packet_t *packet)
+{
+    TRACE(TR_Q_TX, packet_op(packet));
+    fifo_queue_put(&queue_tx, &packet->fifo);
+    pending_set(HAL_LN_EV_UPDATE);
+}
+
+/*
+ * Put packet in tx done queue.
+ */
+static void queue_put_done(packet_t *packet)
+{
+    TRACE(TR_Q_DONE, packet_op(packet));
+    fifo_queue_put(&queue_done, &packet->fifo);
+    pending_set(HAL_LN_EV_UPDATE);
+}
+
+/*
+ * Get packet from free queue.
+ * Rx may use all packets, others must leave LNPACKET_RX_RESERVE packets.
+ */
+static packet_t *packet_get(bool rx)
+{
+    fifo_t         *p = NULL;
+
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+    {
+        if (free_cnt > (rx ? 0 : LNPACKET_RX_RESERVE))
+        {
+            p = fifo_queue_get(&queue_free);
+            free_cnt--;
+        }
+#ifdef LNSTAT
+        else if (!rx && free_cnt)
+        {
+            stat.pool_denied++;
+        }
+#endif
+    }
 
-    p = fifo_queue_get(&queue_free);
     if (p)
-        return &PACKET_FROM_FIFO(p)->lndata;
+        return PACKET_FROM_FIFO(p);
     return NULL;
 }
 
-void hal_ln_packet_free(lnpacket_t *p)
+/*
+ * Put received packet in rx queue.
+ */
+static void packet_put_rx(packet_t *packet)
+{
+    TRACE(TR_Q_RX, packet->lndata.hdr.op);
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+    {
+        fifo_queue_put(&queue_rx, &packet->fifo);
+        rx_cnt++;
+        pending |= HAL_LN_EV_RX;
+    }
+}
+
+/*
+ * Put packet in free queue.
+ * If a received packet is waiting in the scratch buffer, it gets the packet.
+ */
+static void packet_put_free(packet_t *packet)
+{
+    if (rx_scratch_full)
+    {
+        // Rx interrupt does not touch scratch buffer while it is full
+        memcpy(&packet->lndata, &rx_scratch, hal_ln_packet_len(&rx_scratch));
+        packet_put_rx(packet);
+        rx_scratch_full = false;
+        return;
+    }
+
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+    {
+        fifo_queue_put(&queue_free, &packet->fifo);
+        free_cnt++;
+    }
+}
+
+/*
+ * Move packet in scratch buffer to rx queue, if a packet is available.
+ */
+static void rx_scratch_update(void)
+{
+    packet_t       *packet;
+
+    if (!rx_scratch_full)
+        return;
+
+    packet = packet_get(true);
+    if (packet)
+        packet_put_free(packet);
+}
+
+lnpacket_t     *hal_ln_packet_get(void)
 {
     packet_t       *packet;
 
-    packet = PACKET_FROM_LN(p);
-    fifo_queue_put(&queue_free, &packet->fifo);
+    packet = packet_get(false);
+    if (packet)
+        return &packet->lndata;
+    return NULL;
+}
+
+void hal_ln_packet_free(lnpacket_t *p)
+{
+    packet_put_free(PACKET_FROM_LN(p));
 }
 
 uint8_t hal_ln_packet_len(const lnpacket_t *p)
@@ -125,86 +481,463 @@ uint8_t hal_ln_packet_len(const lnpacket_t *p)
 
 
 /************************************************************************/
-/* LocoNet transmitting section                                         */
+/* Traffic profile                                                      */
 /************************************************************************/
 
+#ifdef LNPROFILE
+
 /**
- * Attempts for transmitting a packet before giving up.
- * LN specification only states AT LEAST 25.
+ * Number of entries in top talker table.
  */
-#define TX_ATTEMPTS_MAX 50
-
-static packet_t *tx_buf = NULL;
-static uint8_t  tx_len;
-static uint8_t  tx_idx;
-static uint16_t tx_delay;
-static uint8_t  tx_attempt;
-static bool     tx_collision_flag = false;
-
+#ifndef LNPROFILE_TALKERS
+#define LNPROFILE_TALKERS 8
+#endif
 
 /*
- * Set timer for next transmission attempt.
+ * Opcodes with their own counter. All others share the last counter.
  */
-static void tx_arm_timer(uint16_t cnt)
+static const __flash uint8_t prof_opc[] = {
+    OPC_BUSY, OPC_GPOFF, OPC_GPON, OPC_IDLE,
+    OPC_LOCO_SPD, OPC_LOCO_DIRF, OPC_LOCO_SND, OPC_SW_REQ,
+    OPC_SW_REP, OPC_INPUT_REP, OPC_LONG_ACK, OPC_SLOT_STAT1,
+    OPC_CONSIST_FUNC, OPC_UNLINK_SLOTS, OPC_LINK_SLOTS, OPC_MOVE_SLOTS,
+    OPC_RQ_SL_DATA, OPC_SW_STATE, OPC_SW_ACK, OPC_LOCO_ADR,
+    OPC_PEER_XFER, OPC_SL_RD_DATA, OPC_IMM_PACKET, OPC_WR_SL_DATA
+};
+
+#define PROF_OPC_CNT    (sizeof(prof_opc) + 1)
+
+static uint16_t prof_rx[PROF_OPC_CNT];
+static uint16_t prof_tx[PROF_OPC_CNT];
+static hal_ln_talker_t prof_talker[LNPROFILE_TALKERS];
+
+
+static uint8_t prof_idx(uint8_t op)
 {
-    if (TCB2.CNT >= (cnt - 1))
-        cnt = TCB2.CNT + 2;
-    TCB2.CCMP = cnt;
-    TCB2.INTFLAGS = TCB_CAPT_bm;        // Clear capture interrupt flag
-    TCB2.INTCTRL = TCB_CAPT_bm; // Enable capture interrupt
+    uint8_t         i;
+
+    for (i = 0; i < sizeof(prof_opc); i++)
+        if (prof_opc[i] == op)
+            break;
+    return i;
 }
 
 /*
- * Start transmitting packet.
+ * Update top talker table (space-saving: unknown key replaces the
+ * entry with the lowest count).
  */
-static void tx_start(void)
+static void prof_talker_count(uint8_t type, uint16_t adr)
 {
-    ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
-    {
-        // Restart baudrate generator
-        USART0.BAUD = BAUD_REG;
-
-        // Wait 1 s less than one baudrate generator time tick
-        _delay_us(1E6 / (16 * BAUDRATE) - 1);
+    hal_ln_talker_t *t, *min = prof_talker;
 
-        // Re-check if transmit is still allowed
-        if (TCB2.STATUS & TCB_RUN_bm)
-        {
-            ccl_collision_clear();
-            PORTA.OUTSET = PIN4_bm;     // XDIR = 1
-            USART0.TXDATAL = tx_buf->lndata.raw[0];
-            tx_idx = 1;
-            USART0.CTRLA |= USART_DREIE_bm;     // Enable data register empty interrupt
-            tx_attempt++;
-        }
-        else                    // if not, set timer to start tx when it is allowed
+    for (t = prof_talker; t < &prof_talker[LNPROFILE_TALKERS]; t++)
+    {
+        if (t->cnt && t->type == type && t->adr == adr)
         {
-            tx_arm_timer(tx_delay);
+            t->cnt++;
+            return;
         }
+        if (t->cnt < min->cnt)
+            min = t;
     }
-}
 
-/*
- * Timer interrupt.
- * CD BACKOFF time has elapsed. Start transmitting.
- */
-__attribute__((flatten)) ISR(TCB2_INT_vect)
-{
-    TCB2.INTCTRL = 0;           // Disable capture interrupt
-    tx_start();
+    min->type = type;
+    min->adr = adr;
+    min->cnt++;
 }
 
 /*
- * Data register empty interrupt.
- * Send next byte to USART.
+ * Count packet in profile.
  */
-ISR(USART0_DRE_vect)
+static void prof_count(const lnpacket_t *p, bool tx)
 {
-    if (!ccl_collision())
-    {
-        USART0.TXDATAL = tx_buf->lndata.raw[tx_idx++];
-        if (tx_idx < tx_len)
-            return;
+    uint16_t        adr = p->adr.adrl | (p->adr.adrh << 7);
+
+    if (tx)
+        prof_tx[prof_idx(p->hdr.op)]++;
+    else
+        prof_rx[prof_idx(p->hdr.op)]++;
+
+    switch (p->hdr.op)
+    {
+    case OPC_SW_REQ:
+    case OPC_SW_REP:
+    case OPC_SW_STATE:
+    case OPC_SW_ACK:
+        prof_talker_count(HAL_LN_TALKER_SW, adr + 1);
+        break;
+    case OPC_INPUT_REP:
+        prof_talker_count(HAL_LN_TALKER_INPUT, (adr << 1) + p->input_rep.i + 1);
+        break;
+    case OPC_LOCO_SPD:
+    case OPC_LOCO_DIRF:
+    case OPC_LOCO_SND:
+    case OPC_SLOT_STAT1:
+    case OPC_RQ_SL_DATA:
+        prof_talker_count(HAL_LN_TALKER_SLOT, p->raw[1]);
+        break;
+    case OPC_SL_RD_DATA:
+    case OPC_WR_SL_DATA:
+        prof_talker_count(HAL_LN_TALKER_SLOT, p->raw[2]);
+        break;
+    default:
+        break;
+    }
+}
+
+/*
+ * Count sent packet in profile.
+ * Zero-copy packets are counted from a copy of their first bytes (all that
+ * prof_count uses).
+ */
+static void prof_count_tx(const packet_t *packet)
+{
+    uint8_t         head[4] = { 0 };
+    uint8_t         n = 0;
+
+    if (!packet->xfer)
+    {
+        prof_count(&packet->lndata, true);
+        return;
+    }
+
+    for (uint8_t i = 0; i < packet->xfer->cnt && n < sizeof(head); i++)
+        for (uint8_t j = 0; j < packet->xfer->frag[i].len && n < sizeof(head); j++)
+            head[n++] = packet->xfer->frag[i].data[j];
+
+    prof_count((const lnpacket_t *) head, true);
+}
+
+uint16_t hal_ln_profile_opc(uint8_t op, bool tx)
+{
+    uint16_t        cnt;
+
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+    {
+        cnt = tx ? prof_tx[prof_idx(op)] : prof_rx[prof_idx(op)];
+    }
+    return cnt;
+}
+
+uint8_t hal_ln_profile_talkers(hal_ln_talker_t *t, uint8_t max)
+{
+    uint8_t         cnt = 0;
+
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+    {
+        for (uint8_t i = 0; i < LNPROFILE_TALKERS && cnt < max; i++)
+            if (prof_talker[i].cnt)
+                t[cnt++] = prof_talker[i];
+    }
+    return cnt;
+}
+
+void hal_ln_profile_reset(void)
+{
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+    {
+        memset(prof_rx, 0, sizeof(prof_rx));
+        memset(prof_tx, 0, sizeof(prof_tx));
+        memset(prof_talker, 0, sizeof(prof_talker));
+    }
+}
+
+#endif
+
+
+/************************************************************************/
+/* LocoNet transmitting section                                         */
+/************************************************************************/
+
+/**
+ * Attempts for transmitting a packet before giving up.
+ * LN specification only states AT LEAST 25.
+ */
+#define TX_ATTEMPTS_MAX 50
+
+/**
+ * Time in ms the line may be idle after max CD BACKOFF while a packet is in
+ * transmission, before tx is considered stalled and reset. Max 600.
+ */
+#ifndef LNTX_STALL_MS
+#define LNTX_STALL_MS   20
+#endif
+
+#if LNTX_STALL_MS > 600
+#error "LNTX_STALL_MS too large"
+#endif
+
+// Line idle time (TCB2 ticks) before tx is considered stalled
+#define TX_STALL_TICKS  (CD_BACKOFF_MAX + LNTX_STALL_MS * 1000UL / CD_TICK_TIME)
+
+static packet_t *tx_buf = NULL;
+static uint8_t  tx_len;
+static uint8_t  tx_idx;
+static uint16_t tx_delay;
+static uint8_t  tx_attempt;
+static bool     tx_collision_flag = false;
+#ifdef LNTXVERIFY
+static uint8_t  tx_echo_idx;
+static bool     tx_echo_err;
+static uint8_t  tx_sent[4];     // Last sent bytes, for echo compare
+#endif
+
+// Tx data read position
+static const uint8_t *tx_ptr;
+static uint8_t  tx_left;        // Bytes left in current fragment
+static const hal_ln_frag_t *tx_frag;    // Next fragment
+static uint8_t  tx_frag_cnt;    // Fragments left
+static uint8_t  tx_cksum;
+
+static void     sched_insert(packet_t *packet);
+#ifdef LNBUSMON
+static bool     bus_tx_allowed(void);
+static void     bus_tx_abort(void);
+static void     bus_packet(const packet_t *packet);
+static volatile uint8_t bus_fails;
+#endif
+
+
+/*
+ * Length of zero-copy packet, including checksum.
+ */
+static uint16_t xfer_len(const hal_ln_xfer_t *xfer)
+{
+    uint16_t        len = 1;
+
+    for (uint8_t i = 0; i < xfer->cnt; i++)
+        len += xfer->frag[i].len;
+
+    return len;
+}
+
+/*
+ * Check zero-copy packet: Opcode first, bit 7 cleared in all other bytes,
+ * and length matching the opcode (and the length byte of variable length
+ * packets).
+ * The fragments belong to the caller and can't be masked, so invalid data
+ * is rejected instead.
+ */
+static bool xfer_check(const hal_ln_xfer_t *xfer)
+{
+    uint16_t        len = xfer_len(xfer);
+    uint8_t         idx = 0;
+    uint8_t         op = 0;
+    uint8_t         lenbyte = 0;
+
+    if (!xfer->cnt || !xfer->frag[0].len || len < 2 || len > 127)
+        return false;
+
+    for (uint8_t i = 0; i < xfer->cnt; i++)
+    {
+        const uint8_t  *data = xfer->frag[i].data;
+
+        for (uint8_t j = 0; j < xfer->frag[i].len; j++, idx++)
+        {
+            if (idx == 0)
+            {
+                op = data[j];
+                if (!(op & 0x80))
+                    return false;
+                continue;
+            }
+            if (data[j] & 0x80)
+                return false;
+            if (idx == 1)
+                lenbyte = data[j];
+        }
+    }
+
+    switch (op & 0x60)
+    {
+    case 0x00:
+        return len == 2;
+    case 0x20:
+        return len == 4;
+    case 0x40:
+        return len == 6;
+    default:
+        return len == lenbyte;
+    }
+}
+
+/*
+ * Make packet the current tx packet.
+ */
+static void tx_load(packet_t *packet, uint16_t delay)
+{
+#ifdef LNSTAT
+    stat.tx_total++;
+#endif
+
+    tx_buf = packet;
+    tx_len = packet->xfer ? xfer_len(packet->xfer) : hal_ln_packet_len(&packet->lndata);
+    tx_delay = delay;
+    tx_attempt = 0;
+}
+
+/*
+ * Set tx data read position to start of packet.
+ */
+static void tx_rewind(void)
+{
+    if (tx_buf->xfer)
+    {
+        tx_left = 0;
+        tx_frag = tx_buf->xfer->frag;
+        tx_frag_cnt = tx_buf->xfer->cnt;
+    }
+    else
+    {
+        tx_ptr = tx_buf->lndata.raw;
+        tx_left = tx_len;       // Checksum stored in packet
+        tx_frag_cnt = 0;
+    }
+    tx_cksum = 0xff;
+}
+
+/*
+ * Get next byte to send. For zero-copy packets the checksum is calculated
+ * on the way, and sent after the last data byte. Pool packets are sent with
+ * the checksum stored in the packet.
+ */
+__attribute__((always_inline))
+static inline uint8_t tx_byte(void)
+{
+    uint8_t         data;
+
+    while (!tx_left && tx_frag_cnt)
+    {
+        tx_ptr = tx_frag->data;
+        tx_left = tx_frag->len;
+        tx_frag++;
+        tx_frag_cnt--;
+    }
+
+    if (!tx_left)
+        return tx_cksum;
+
+    tx_left--;
+    data = *tx_ptr++;
+    tx_cksum ^= data;
+    return data;
+}
+
+/*
+ * Set timer for next transmission attempt.
+ */
+static void tx_arm_timer(uint16_t cnt)
+{
+    TRACE(TR_TX_ARM, cnt * CD_TICK_TIME / 20); // Max 2760 us fits in 8 bits
+    if (TCB2.CNT >= (cnt - 1))
+        cnt = TCB2.CNT + 2;
+    TCB2.CCMP = cnt;
+    TCB2.INTFLAGS = TCB_CAPT_bm;        // Clear capture interrupt flag
+    TCB2.INTCTRL = TCB_CAPT_bm; // Enable capture interrupt
+}
+
+#ifdef LNBACKOFF
+/*
+ * Contention level (0-3). Raised on every retry, lowered on every success.
+ */
+static uint8_t  tx_contention;
+
+/*
+ * Next CD BACKOFF after a failed attempt.
+ * Subtracts 0.5 bit time plus a random part from delay. The random part
+ * grows with contention (up to 4, 8, 16 or 32 ticks). If minimum backoff
+ * is reached, the random part is added to the minimum instead, so nodes
+ * at minimum backoff don't keep colliding with each other.
+ */
+static uint16_t tx_backoff(uint16_t delay)
+{
+    uint8_t         rnd = ccl_rnd() & ((4 << tx_contention) - 1);
+
+    if (tx_contention < 3)
+        tx_contention++;
+
+    delay -= (30 / CD_TICK_TIME) + rnd;
+    if ((int16_t)delay < CD_BACKOFF_MIN)
+        delay = CD_BACKOFF_MIN + rnd;
+
+    return delay;
+}
+#endif
+
+/*
+ * Start transmitting packet.
+ */
+static void tx_start(void)
+{
+    bool            start = false;
+    uint8_t         data;
+
+    tx_rewind();
+    data = tx_byte();
+
+    // Only the carrier check and the first byte need interrupts disabled.
+    // The start bit begins at the first baudrate generator tick after the
+    // restart, so the check is at most 1/16 bit before the start bit.
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+    {
+        // Re-check if transmit is still allowed
+        if (TCB2.STATUS & TCB_RUN_bm)
+        {
+            USART0.BAUD = BAUD_REG;     // Restart baudrate generator
+            ccl_collision_clear();
+            PORTA.OUTSET = PIN4_bm;     // XDIR = 1
+            USART0.TXDATAL = data;
+            start = true;
+        }
+    }
+
+    if (start)
+    {
+        tx_idx = 1;
+#ifdef LNTXVERIFY
+        tx_sent[0] = data;
+        tx_echo_idx = 0;
+        tx_echo_err = false;
+#endif
+        USART0.CTRLA |= USART_DREIE_bm; // Enable data register empty interrupt
+        tx_attempt++;
+        TRACE(TR_TX_START, tx_attempt);
+    }
+    else                        // if not, set timer to start tx when it is allowed
+    {
+        TRACE(TR_TX_BUSY, 0);
+        tx_arm_timer(tx_delay);
+    }
+}
+
+/*
+ * Timer interrupt.
+ * CD BACKOFF time has elapsed. Start transmitting.
+ */
+__attribute__((flatten)) ISR(TCB2_INT_vect)
+{
+    CYCLES_ISR_START();
+    TCB2.INTCTRL = 0;           // Disable capture interrupt
+    tx_start();
+    CYCLES_ISR_END(HAL_LN_CYC_TCB2);
+}
+
+/*
+ * Data register empty interrupt.
+ * Send next byte to USART.
+ */
+static inline void usart_dre(void)
+{
+    if (!ccl_collision())
+    {
+        uint8_t         data = tx_byte();
+
+        USART0.TXDATAL = data;
+#ifdef LNTXVERIFY
+        tx_sent[tx_idx & 0x03] = data;
+#endif
+        if (++tx_idx < tx_len)
+            return;
     }
 
     // Last byte has been written to USART
@@ -219,24 +952,50 @@ ISR(USART0_DRE_vect)
     USART0.CTRLA = tmp;
 }
 
+ISR(USART0_DRE_vect)
+{
+    CYCLES_ISR_START();
+    usart_dre();
+    CYCLES_ISR_END(HAL_LN_CYC_DRE);
+}
+
 /*
  * TX complete interrupt.
  * End packet transmission and check for collision.
  */
-__attribute__((flatten)) ISR(USART0_TXC_vect)
+static inline void usart_txc(void)
 {
+    bool            retry = false;
+
     PORTA.OUTCLR = PIN4_bm;     // XDIR = 0
     USART0.CTRLA &= ~USART_TXCIE_bm;
 
     if (ccl_collision())
     {
+        retry = true;
         tx_collision_flag = true;
 #ifdef LNSTAT
         stat.tx_collisions++;
 #endif
+    }
+#ifdef LNTXVERIFY
+    else if (tx_echo_err || tx_echo_idx != tx_len)
+    {
+        // Echo didn't match sent data
+        retry = true;
+#ifdef LNSTAT
+        stat.tx_echo_err++;
+#endif
+    }
+#endif
 
+    if (retry)
+    {
         if (tx_attempt < TX_ATTEMPTS_MAX)
         {
+#ifdef LNBACKOFF
+            tx_delay = tx_backoff(tx_delay);
+#else
             if (tx_delay > CD_BACKOFF_MIN)
             {
                 // Subtract 0.5 to 1 bit time from delay, and try again
@@ -244,116 +1003,519 @@ __attribute__((flatten)) ISR(USART0_TXC_vect)
                 if (tx_delay < CD_BACKOFF_MIN)
                     tx_delay = CD_BACKOFF_MIN;
             }
+#endif
+            TRACE(TR_TX_END, 1);
             tx_arm_timer(tx_delay);
             return;
         }
 
+        TRACE(TR_TX_END, 2);
+#ifdef LNBUSMON
+        if (bus_fails < 0xff)
+            bus_fails++;
+#endif
         tx_buf->res = HAL_LN_FAIL;
 #ifdef LNSTAT
         stat.tx_fail++;
 #endif
     }
-    else
+    else
+    {
+        TRACE(TR_TX_END, 0);
+#ifdef LNBUSMON
+        bus_fails = 0;
+#endif
+#ifdef LNBACKOFF
+        if (tx_contention)
+            tx_contention--;
+#endif
+        tx_buf->res = HAL_LN_SUCCESS;
+#ifdef LNSTAT
+        stat.tx_success++;
+#endif
+    }
+
+#ifdef LNSTAT
+    if (stat.tx_max_attempts < tx_attempt)
+        stat.tx_max_attempts = tx_attempt;
+#endif
+
+    if (tx_buf->res == HAL_LN_SUCCESS && tx_buf->grp)
+    {
+        // Send group: Continue with next member at minimum backoff,
+        // before anything else from tx queue gets a chance.
+        packet_t       *next = tx_buf->grp;
+
+        tx_buf->grp = NULL;
+        queue_put_done(tx_buf);
+        tx_load(next, CD_BACKOFF_MIN);
+        tx_arm_timer(tx_delay);
+        return;
+    }
+
+    // Put sent packet in done queue, for further processing outside interrupt
+    // A failed group member takes the rest of the group along with it
+    queue_put_done(tx_buf);
+    tx_buf = NULL;
+}
+
+__attribute__((flatten)) ISR(USART0_TXC_vect)
+{
+    CYCLES_ISR_START();
+    usart_txc();
+    CYCLES_ISR_END(HAL_LN_CYC_TXC);
+}
+
+/*
+ * Calculate checksum of packet to send.
+ * Returns false if packet is too large to send.
+ */
+static bool tx_prepare(lnpacket_t *lnpacket)
+{
+    uint8_t         len, cksum;
+    uint8_t        *data;
+
+    len = hal_ln_packet_len(lnpacket);
+    if (len < 2 || len > LNPACKET_SIZE_MAX)
+        return false;
+
+    len -= 2;
+    cksum = ~lnpacket->raw[0];
+    data = &lnpacket->raw[1];
+    while (len--)
+    {
+        *data &= 0x7f;
+        cksum ^= *data++;
+    }
+    *data = cksum;
+
+    return true;
+}
+
+void hal_ln_send(lnpacket_t *lnpacket, hal_ln_tx_done_cb_t * cb, void *ctx)
+{
+    packet_t       *packet;
+
+    CYCLES_API_START();
+
+    packet = PACKET_FROM_LN(lnpacket);
+    packet->cb = cb;
+    packet->ctx = ctx;
+    packet->grp = NULL;
+    packet->period = 0;
+
+    if (!tx_prepare(lnpacket))
+    {
+        packet->res = HAL_LN_FAIL;
+#ifdef LNSTAT
+        stat.tx_fail++;
+#endif
+        queue_put_done(packet);
+    }
+    else
+        queue_put_tx(packet);
+
+    CYCLES_API_END(HAL_LN_CYC_SEND);
+}
+
+void hal_ln_send_prepared(lnpacket_t *lnpacket, hal_ln_tx_done_cb_t * cb, void *ctx)
+{
+    packet_t       *packet;
+
+    packet = PACKET_FROM_LN(lnpacket);
+    packet->cb = cb;
+    packet->ctx = ctx;
+    packet->grp = NULL;
+    packet->period = 0;
+
+    queue_put_tx(packet);
+}
+
+void hal_ln_send_xfer(hal_ln_xfer_t *xfer, hal_ln_tx_done_cb_t * cb, void *ctx)
+{
+    packet_t       *packet;
+
+    packet = PACKET_FROM_XFER(xfer);
+    packet->cb = cb;
+    packet->ctx = ctx;
+    packet->grp = NULL;
+    packet->period = 0;
+    packet->xfer = xfer;
+
+    if (!xfer_check(xfer))
+    {
+        packet->res = HAL_LN_FAIL;
+#ifdef LNSTAT
+        stat.tx_fail++;
+#endif
+        queue_put_done(packet);
+        return;
+    }
+
+    queue_put_tx(packet);
+}
+
+void hal_ln_send_group(lnpacket_t *lnpacket[], uint8_t cnt, hal_ln_tx_done_cb_t * cb, void *ctx)
+{
+    packet_t       *packet;
+    bool            ok = true;
+
+    if (!cnt)
+        return;
+
+    // Chain group members. Only the last member carries the callback
+    for (uint8_t i = 0; i < cnt; i++)
+    {
+        packet = PACKET_FROM_LN(lnpacket[i]);
+        packet->grp = (i + 1 < cnt) ? PACKET_FROM_LN(lnpacket[i + 1]) : NULL;
+        packet->cb = packet->grp ? NULL : cb;
+        packet->ctx = packet->grp ? NULL : ctx;
+        packet->period = 0;
+        if (!tx_prepare(lnpacket[i]))
+            ok = false;
+    }
+
+    packet = PACKET_FROM_LN(lnpacket[0]);
+    if (!ok)
+    {
+        packet->res = HAL_LN_FAIL;
+#ifdef LNSTAT
+        stat.tx_fail++;
+#endif
+        queue_put_done(packet);
+        return;
+    }
+
+    queue_put_tx(packet);
+}
+
+/*
+ * Handle tx queue.
+ */
+static void tx_update(void)
+{
+    fifo_t         *packetfifo;
+
+    if (tx_buf)
+    {
+#ifdef LNBUSMON
+        bus_tx_abort();
+#endif
+        return;                 // Tx in progress
+    }
+
+#ifdef LNBUSMON
+    if (!bus_tx_allowed())
+        return;                 // Tx held back
+#endif
+
+    // Tx idle: Send next packet in queue
+
+    packetfifo = fifo_queue_get(&queue_tx);
+    if (!packetfifo)
+        return;                 // No packets in tx queue
+
+    tx_load(PACKET_FROM_FIFO(packetfifo), CD_BACKOFF_MAX);
+
+    // Check if transmit is allowed now
+    if ((TCB2.STATUS & TCB_RUN_bm) && (TCB2.CNT >= tx_delay))
+        tx_start();
+    else                        // if not, set timer to start tx when it is allowed
+        tx_arm_timer(tx_delay);
+}
+
+/*
+ * Tx stall supervision.
+ * TCB2 counts the time the line has been idle (restarted on every edge).
+ * A packet in transmission starts at the latest at max CD BACKOFF after the
+ * line became idle, and keeps the line busy until it is done. So if the line
+ * has been idle for max CD BACKOFF plus LNTX_STALL_MS, and the packet is
+ * still not done, an interrupt has been lost (TCB2 capture, DRE or TXC).
+ * Tx is then reset to idle and the packet is done with HAL_LN_TIMEOUT.
+ */
+static void tx_watch(void)
+{
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+    {
+        if (tx_buf && (TCB2.STATUS & TCB_RUN_bm) && TCB2.CNT >= TX_STALL_TICKS)
+        {
+            TCB2.INTCTRL = 0;   // Disable capture interrupt
+            TCB2.INTFLAGS = TCB_CAPT_bm;
+            USART0.CTRLA &= ~(USART_DREIE_bm | USART_TXCIE_bm);
+            USART0.STATUS = USART_TXCIF_bm;
+            // A byte left in the USART can't be flushed, but the line
+            // driver is disabled, so it doesn't reach the line
+            PORTA.OUTCLR = PIN4_bm;     // XDIR = 0
+            ccl_collision_clear();
+
+            TRACE(TR_TX_END, 3);
+            tx_buf->res = HAL_LN_TIMEOUT;
+#ifdef LNBUSMON
+            if (bus_fails < 0xff)
+                bus_fails++;
+#endif
+#ifdef LNSTAT
+            stat.tx_stall++;
+#endif
+            queue_put_done(tx_buf);
+            tx_buf = NULL;
+        }
+    }
+}
+
+/*
+ * RTC periodic interrupt.
+ * Only enabled while a packet is in transmission, to wake up for tx stall
+ * supervision (no other interrupt may come if tx has stalled), and when a
+ * timed wakeup is requested (hal_ln_wake_tick).
+ */
+ISR(RTC_PIT_vect)
+{
+    RTC.PITINTFLAGS = RTC_PI_bm;
+    pending |= HAL_LN_EV_UPDATE;
+}
+
+/*
+ * Handle tx done queue (callback and packet freeing).
+ */
+static void tx_done_update(void)
+{
+    fifo_t         *packetfifo;
+    packet_t       *packet;
+
+    packetfifo = fifo_queue_get(&queue_done);
+    if (!packetfifo)
+        return;                 // No packets in done queue
+
+    packet = PACKET_FROM_FIFO(packetfifo);
+
+#ifdef LNPROFILE
+    if (packet->res == HAL_LN_SUCCESS)
+        prof_count_tx(packet);
+#endif
+#ifdef LNBUSMON
+    if (packet->res == HAL_LN_SUCCESS)
+        bus_packet(packet);
+#endif
+
+    // Failed send group: Free remaining members, and report to last one
+    while (packet->grp)
+    {
+        packet_t       *next = packet->grp;
+
+        packet->grp = NULL;
+        next->res = packet->res;
+        packet_put_free(packet);
+        packet = next;
+    }
+
+    TRACE(TR_DONE_CB, packet->res);
+    if (packet->cb)
+        packet->cb(packet->ctx, packet->res);   // Tx done callback
+
+    if (packet->period)
+    {
+        // Periodic packet: Keep packet and schedule next tx
+        packet->time += packet->period;
+        if ((int16_t)(hal_ln_time() - packet->time) > 0)
+            packet->time = hal_ln_time();       // Late, don't try to catch up
+        sched_insert(packet);
+        return;
+    }
+
+    if (!packet->xfer)
+        packet_put_free(packet);        // Zero-copy packet belongs to caller
+}
+
+/************************************************************************/
+/* LocoNet scheduled transmitting section                               */
+/************************************************************************/
+
+/**
+ * Packets due within this number of ticks are released right away.
+ * Covers the RTC CMP register synchronization time.
+ */
+#define SCHED_MARGIN    2
+
+/*
+ * Scheduled packets, sorted by tx time.
+ */
+static packet_t *sched = NULL;
+
+/*
+ * RTC compare write deferred to hal_ln_update (CMP register busy).
+ */
+static volatile bool sched_cmp_wait = false;
+
+
+/*
+ * Release due packets to tx queue, and set RTC compare for the next one.
+ * Must be called with interrupts disabled.
+ */
+static void sched_release(void)
+{
+    packet_t       *packet;
+
+    while ((packet = sched) != NULL)
+    {
+        if ((int16_t)(RTC.CNT + SCHED_MARGIN - packet->time) >= 0)
+        {
+            sched = packet->sched;
+            queue_put_tx(packet);
+            continue;
+        }
+
+        if (RTC.STATUS & RTC_CMPBUSY_bm)
+        {
+            // Previous CMP write still synchronizing (up to 2 RTC clocks).
+            // Don't wait here with interrupts disabled, retry from hal_ln_update.
+            sched_cmp_wait = true;
+            pending |= HAL_LN_EV_UPDATE;
+            return;
+        }
+        sched_cmp_wait = false;
+        RTC.CMP = packet->time;
+        RTC.INTFLAGS = RTC_CMP_bm;
+        RTC.INTCTRL = RTC_CMP_bm;
+        return;
+    }
+
+    sched_cmp_wait = false;
+    RTC.INTCTRL = 0;
+}
+
+/*
+ * Retry deferred RTC compare write.
+ */
+static void sched_update(void)
+{
+    if (!sched_cmp_wait)
+        return;
+
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
     {
-        tx_buf->res = HAL_LN_SUCCESS;
-#ifdef LNSTAT
-        stat.tx_success++;
-#endif
+        sched_release();
     }
+}
 
-    // Put sent packet in done queue, for further processing outside interrupt
-    fifo_queue_put(&queue_done, &tx_buf->fifo);
-    tx_buf = NULL;
+/*
+ * Put packet in schedule list.
+ */
+static void sched_insert(packet_t *packet)
+{
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+    {
+        packet_t      **pp = &sched;
 
-#ifdef LNSTAT
-    if (stat.tx_max_attempts < tx_attempt)
-        stat.tx_max_attempts = tx_attempt;
-#endif
+        while (*pp && (int16_t)(packet->time - (*pp)->time) >= 0)
+            pp = &(*pp)->sched;
+        packet->sched = *pp;
+        *pp = packet;
+
+        if (sched == packet)
+            sched_release();
+    }
 }
 
-void hal_ln_send(lnpacket_t *lnpacket, hal_ln_tx_done_cb_t * cb, void *ctx)
+/*
+ * RTC compare interrupt.
+ * Scheduled tx time reached.
+ */
+ISR(RTC_CNT_vect)
+{
+    CYCLES_ISR_START();
+    RTC.INTFLAGS = RTC_CMP_bm;
+    TRACE(TR_SCHED, 0);
+    sched_release();
+    CYCLES_ISR_END(HAL_LN_CYC_RTC);
+}
+
+/*
+ * Schedule packet.
+ * Period is only set if packet is valid, so a rejected packet is never
+ * rescheduled.
+ */
+static void send_at(lnpacket_t *lnpacket, uint16_t time, uint16_t period, hal_ln_tx_done_cb_t * cb, void *ctx)
 {
-    uint8_t         len, cksum;
-    uint8_t        *data;
     packet_t       *packet;
 
     packet = PACKET_FROM_LN(lnpacket);
     packet->cb = cb;
     packet->ctx = ctx;
+    packet->grp = NULL;
+    packet->time = time;
+    packet->period = 0;
 
-    len = hal_ln_packet_len(lnpacket);
-    if (len > LNPACKET_SIZE_MAX)
+    if (!tx_prepare(lnpacket))
     {
         packet->res = HAL_LN_FAIL;
 #ifdef LNSTAT
         stat.tx_fail++;
 #endif
-        fifo_queue_put(&queue_done, &packet->fifo);
+        queue_put_done(packet);
         return;
     }
 
-    len -= 2;
-    cksum = ~lnpacket->raw[0];
-    data = &lnpacket->raw[1];
-    while (len--)
-    {
-        *data &= 0x7f;
-        cksum ^= *data++;
-    }
-    *data = cksum;
-
-    fifo_queue_put(&queue_tx, &packet->fifo);
+    packet->period = period;
+    sched_insert(packet);
 }
 
-/*
- * Handle tx queue.
- */
-static void tx_update(void)
+void hal_ln_send_at(lnpacket_t *lnpacket, uint16_t time, hal_ln_tx_done_cb_t * cb, void *ctx)
 {
-    fifo_t         *packetfifo;
-
-    if (tx_buf)
-        return;                 // Tx in progress
+    send_at(lnpacket, time, 0, cb, ctx);
+}
 
-    // Tx idle: Send next packet in queue
+void hal_ln_send_every(lnpacket_t *lnpacket, uint16_t period, hal_ln_tx_done_cb_t * cb, void *ctx)
+{
+    send_at(lnpacket, hal_ln_time() + period, period, cb, ctx);
+}
 
-    packetfifo = fifo_queue_get(&queue_tx);
-    if (!packetfifo)
-        return;                 // No packets in tx queue
+void hal_ln_send_cancel(lnpacket_t *lnpacket)
+{
+    packet_t       *packet = PACKET_FROM_LN(lnpacket);
+    bool            found = false;
 
-#ifdef LNSTAT
-    stat.tx_total++;
-#endif
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+    {
+        packet_t      **pp = &sched;
 
-    tx_buf = PACKET_FROM_FIFO(packetfifo);
-    tx_len = hal_ln_packet_len(&tx_buf->lndata);
-    tx_delay = CD_BACKOFF_MAX;
-    tx_attempt = 0;
+        while (*pp && *pp != packet)
+            pp = &(*pp)->sched;
+        if (*pp)
+        {
+            *pp = packet->sched;
+            found = true;
+        }
+        packet->period = 0;
+    }
 
-    // Check if transmit is allowed now
-    if ((TCB2.STATUS & TCB_RUN_bm) && (TCB2.CNT >= tx_delay))
-        tx_start();
-    else                        // if not, set timer to start tx when it is allowed
-        tx_arm_timer(tx_delay);
+    // If not found, packet is on its way through tx and is freed when done
+    if (found)
+        packet_put_free(packet);
 }
 
-/*
- * Handle tx done queue (callback and packet freeing).
- */
-static void tx_done_update(void)
+#ifdef LNSTAT
+void hal_ln_stat_get(hal_ln_stat_t *s, bool reset)
 {
-    fifo_t         *packetfifo;
-    packet_t       *packet;
-
-    packetfifo = fifo_queue_get(&queue_done);
-    if (!packetfifo)
-        return;                 // No packets in done queue
-
-    packet = PACKET_FROM_FIFO(packetfifo);
-    if (packet->cb)
-        packet->cb(packet->ctx, packet->res);   // Tx done callback
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+    {
+        if (s)
+            *s = stat;
+        if (reset)
+            memset(&stat, 0, sizeof(stat));
+    }
+}
+#endif
 
-    fifo_queue_put(&queue_free, packetfifo);
+void hal_ln_queues(hal_ln_queues_t *q)
+{
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+    {
+        q->free = free_cnt;
+        q->tx = fifo_queue_size(&queue_tx);
+        q->rx = rx_cnt;
+        q->done = fifo_queue_size(&queue_done);
+    }
 }
 
 bool hal_ln_tx_collision(void)
@@ -374,40 +1536,240 @@ bool hal_ln_tx_collision(void)
 /* LocoNet receiving section                                            */
 /************************************************************************/
 
+/**
+ * Max time in ms between bytes of a packet, before a partial packet is dropped.
+ */
+#ifndef LNRX_TIMEOUT_MS
+#define LNRX_TIMEOUT_MS 2
+#endif
+
 typedef enum
 {
     RXS_IDLE,
     RXS_DATA
 } rx_state_t;
 
+/*
+ * Time of last received byte.
+ */
+static volatile uint16_t rx_last;
+
+#ifdef LNRXDIRECT
+
+/**
+ * Max number of opcodes received directly into rings.
+ */
+#ifndef LNRXDIRECT_CNT
+#define LNRXDIRECT_CNT  4
+#endif
+
+typedef struct
+{
+    uint8_t         op;         // 0 if unused
+    hal_ln_rx_ring_t *ring;
+} direct_t;
+
+static direct_t direct_tab[LNRXDIRECT_CNT];
+static hal_ln_rx_ring_t *direct_rx;     // Ring of packet being received
+static bool     direct_abort;   // direct_rx removed during packet
 
 /*
- * RX complete interrupt.
+ * Find ring with free entry for opcode.
  */
-__attribute__((flatten)) ISR(USART0_RXC_vect)
+static hal_ln_rx_ring_t *direct_find(uint8_t op)
+{
+    for (direct_t * d = direct_tab; d < &direct_tab[LNRXDIRECT_CNT]; d++)
+    {
+        if (d->op == op)
+        {
+            hal_ln_rx_ring_t *ring = d->ring;
+
+            if ((uint8_t)(ring->head - ring->tail) < ring->cnt)
+                return ring;
+            ring->overflow++;
+            return NULL;
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Entry in ring.
+ */
+static inline uint8_t *direct_entry(hal_ln_rx_ring_t *ring, uint8_t idx)
+{
+    return ring->buf + (idx & (ring->cnt - 1)) * ring->size;
+}
+
+bool hal_ln_rx_direct(uint8_t op, hal_ln_rx_ring_t *ring)
+{
+    direct_t       *unused = NULL;
+
+    if (ring && (ring->size < 2 || !ring->cnt || (ring->cnt & (ring->cnt - 1))))
+        return false;
+
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+    {
+        for (direct_t * d = direct_tab; d < &direct_tab[LNRXDIRECT_CNT]; d++)
+        {
+            if (d->op == op)
+            {
+                d->op = 0;
+                if (d->ring == direct_rx)
+                {
+                    direct_rx = NULL;   // Stop writing into removed ring
+                    direct_abort = true;
+                }
+            }
+            if (!d->op && !unused)
+                unused = d;
+        }
+        if (ring && unused)
+        {
+            unused->ring = ring;
+            unused->op = op;
+        }
+    }
+
+    return !ring || unused;
+}
+
+lnpacket_t     *hal_ln_rx_ring_get(hal_ln_rx_ring_t *ring)
+{
+    if (ring->head == ring->tail)
+        return NULL;
+
+    return (lnpacket_t *) direct_entry(ring, ring->tail);
+}
+
+void hal_ln_rx_ring_free(hal_ln_rx_ring_t *ring)
+{
+    if (ring->head == ring->tail)
+        return;
+
+    ring->tail++;
+
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+    {
+        bool            empty = true;
+
+        // Clear flag when all rings are empty
+        for (direct_t * d = direct_tab; d < &direct_tab[LNRXDIRECT_CNT]; d++)
+            if (d->op && d->ring->head != d->ring->tail)
+                empty = false;
+        if (empty)
+            pending &= ~HAL_LN_EV_DIRECT;
+    }
+}
+
+#endif
+
+
+/*
+ * Flags for received byte.
+ */
+#define RXB_FERR        0x01    // Framing error
+#define RXB_GAP         0x02    // Long gap before byte
+#define RXB_ECHO        0x04    // Echo of our own tx
+#define RXB_LOST        0x08    // Bytes lost before byte (rx byte ring full)
+
+#ifdef LNRXSPLIT
+
+/**
+ * Size of rx byte ring. Must be a power of 2, max 128.
+ */
+#ifndef LNRXSPLIT_SIZE
+#define LNRXSPLIT_SIZE  32
+#endif
+
+#if LNRXSPLIT_SIZE > 128 || (LNRXSPLIT_SIZE & (LNRXSPLIT_SIZE - 1))
+#error "LNRXSPLIT_SIZE must be a power of 2, max 128"
+#endif
+
+/*
+ * Rx byte ring. Written by rx interrupt only (head), read by
+ * hal_ln_update only (tail), so no locking is needed.
+ */
+static uint8_t  rxb_data[LNRXSPLIT_SIZE];
+static uint8_t  rxb_flags[LNRXSPLIT_SIZE];
+static volatile uint8_t rxb_head;
+static volatile uint8_t rxb_tail;
+
+#define rx_pending(ev)  pending_set(ev)
+#else
+#define rx_pending(ev)  (pending |= (ev))       // Called from rx interrupt
+#endif
+
+/*
+ * Framing of received byte.
+ * Called from rx interrupt, or from hal_ln_update with LNRXSPLIT.
+ */
+__attribute__((always_inline))
+static inline void rx_byte(uint8_t flags, uint8_t data)
 {
     static lnpacket_t *buf = NULL;
     static rx_state_t state = RXS_IDLE;
     static uint8_t  idx = 0;
     static uint8_t  cksum;
     static uint8_t  len;
-    uint8_t         data;
-    uint8_t         status;
+#ifdef LNSTAT
+    static bool     ferr_zero = false;
+#endif
+#ifdef LNRXDIRECT
+    static uint8_t *direct_buf;
 
-    status = USART0.RXDATAH;
-    data = USART0.RXDATAL;
+    if (direct_abort)
+    {
+        // Ring removed while receiving into it: Drop rest of packet
+        direct_abort = false;
+        state = RXS_IDLE;
+        idx = 0;
+    }
+#endif
+
+    // Drop partial packet if the line has been idle too long since last byte
+    if (state == RXS_DATA && (flags & RXB_GAP))
+    {
+        state = RXS_IDLE;
+        idx = 0;
+#ifdef LNSTAT
+        stat.rx_timeout++;
+#endif
+    }
+
+#ifdef LNRXSPLIT
+    if ((flags & RXB_LOST) && state == RXS_DATA)
+    {
+        state = RXS_IDLE;       // Rest of packet can't be trusted
+        idx = 0;
+#ifdef LNSTAT
+        stat.rx_partial++;
+#endif
+    }
+#endif
 
-    if ((status & USART_FERR_bm))       // Framing error: Restart rx packet
+    if ((flags & RXB_FERR))     // Framing error: Restart rx packet
     {
+        TRACE(TR_RX_FERR, data);
         state = RXS_IDLE;
         idx = 0;
 #ifdef LNSTAT
         stat.rx_collisions++;
+        if (data == 0 && !ferr_zero)
+            stat.rx_ferr_zero++;        // All zero byte (counted once in a row)
+        ferr_zero = (data == 0);
 #endif
     }
+#ifdef LNSTAT
+    else
+    {
+        ferr_zero = false;
+    }
+#endif
 
 #ifndef LNECHO
-    if (PORTA.IN & PIN4_bm)     // XDIR
+    if (flags & RXB_ECHO)
     {
         state = RXS_IDLE;       // Discard received echo of our own tx
         return;
@@ -431,11 +1793,50 @@ __attribute__((flatten)) ISR(USART0_RXC_vect)
     {
     case RXS_IDLE:
     default:
-        if (!buf)
+#ifdef LNRXDIRECT
+        // Registered opcode: Receive directly into ring
+        direct_rx = (data & 0x80) ? direct_find(data) : NULL;
+        if (direct_rx)
+        {
+            direct_buf = direct_entry(direct_rx, direct_rx->head);
+            direct_buf[0] = data;
+            cksum = data;
+            idx = 1;
+            state = RXS_DATA;
+            break;
+        }
+#endif
+        if (!buf || buf == &rx_scratch)
         {
-            buf = hal_ln_packet_get();
-            if (!buf)
+            packet_t       *packet = NULL;
+
+            if (rx_cnt >= LNPACKET_RX_MAX)
+            {
+                // Over quota: Drop packet (scratch buffer would deliver it)
+                buf = NULL;
+                if (data & 0x80)
+                {
+                    TRACE(TR_RX_END, 3);
+#ifdef LNSTAT
+                    stat.rx_quota++;
+#endif
+                }
+                return;
+            }
+
+            packet = packet_get(true);
+            if (packet)
+            {
+                buf = &packet->lndata;
+            }
+            else if (!rx_scratch_full)
             {
+                buf = &rx_scratch;      // No packet available, use scratch buffer
+            }
+            else
+            {
+                buf = NULL;
+                TRACE(TR_RX_END, 3);
 #ifdef LNSTAT
                 stat.rx_nomem++;
 #endif
@@ -444,6 +1845,7 @@ __attribute__((flatten)) ISR(USART0_RXC_vect)
         }
         if (data & 0x80)
         {
+            TRACE(TR_RX_OP, data);
             buf->raw[0] = data;
             cksum = data;
             idx = 1;
@@ -458,6 +1860,46 @@ __attribute__((flatten)) ISR(USART0_RXC_vect)
         break;
 
     case RXS_DATA:
+#ifdef LNRXDIRECT
+        if (direct_rx)
+        {
+            if (idx < direct_rx->size)
+                direct_buf[idx] = data;
+            idx++;
+            cksum ^= data;
+            if (idx == 2)
+                len = hal_ln_packet_len((lnpacket_t *) direct_buf);
+            if (idx >= len)
+            {
+                if (cksum == 0xff)
+                {
+                    if (idx <= direct_rx->size)
+                    {
+                        direct_rx->head++;
+                        rx_pending(HAL_LN_EV_DIRECT);
+                        TRACE(TR_RX_END, 0);
+#ifdef LNSTAT
+                        stat.rx_success++;
+#endif
+                    }
+                    else
+                    {
+                        direct_rx->drop++;
+                    }
+                }
+                else
+                {
+                    TRACE(TR_RX_END, 1);
+#ifdef LNSTAT
+                    stat.rx_checksum++;
+#endif
+                }
+                state = RXS_IDLE;
+                idx = 0;
+            }
+            break;
+        }
+#endif
         if (idx < LNPACKET_SIZE_MAX)
             buf->raw[idx] = data;
         idx++;
@@ -473,14 +1915,27 @@ __attribute__((flatten)) ISR(USART0_RXC_vect)
                 if (idx <= LNPACKET_SIZE_MAX)
                 {
                     // Put in rx queue (packet fits in buffer)
-                    fifo_queue_put(&queue_rx, &PACKET_FROM_LN(buf)->fifo);
+                    if (buf == &rx_scratch)
+                    {
+                        rx_scratch_full = true;
+                        rx_pending(HAL_LN_EV_UPDATE);
+#ifdef LNSTAT
+                        stat.rx_scratch++;
+#endif
+                    }
+                    else
+                    {
+                        packet_put_rx(PACKET_FROM_LN(buf));
+                    }
                     buf = NULL;
+                    TRACE(TR_RX_END, 0);
 #ifdef LNSTAT
                     stat.rx_success++;
 #endif
                 }
                 else
                 {
+                    TRACE(TR_RX_END, 2);
                     // Packet correctly received, but didn't fit in reduced size buffer
 #ifdef LNSTAT
                     stat.rx_success_large++;
@@ -489,6 +1944,7 @@ __attribute__((flatten)) ISR(USART0_RXC_vect)
             }
             else
             {
+                TRACE(TR_RX_END, 1);
 #ifdef LNSTAT
                 stat.rx_checksum++;
 #endif
@@ -500,14 +1956,129 @@ __attribute__((flatten)) ISR(USART0_RXC_vect)
     }
 }
 
+/*
+ * RX complete interrupt.
+ */
+static inline void usart_rxc(void)
+{
+    uint8_t         data;
+    uint8_t         status;
+    uint8_t         flags = 0;
+    uint16_t        now;
+#ifdef LNRXSPLIT
+    static uint8_t  lost = 0;
+    uint8_t         head;
+#endif
+
+#ifdef LNSFD
+    // Receive start interrupt shares this vector. Only used for wake up.
+    if (USART0.STATUS & USART_RXSIF_bm)
+    {
+        USART0.STATUS = USART_RXSIF_bm;
+        if (!(USART0.STATUS & USART_RXCIF_bm))
+            return;
+    }
+#endif
+
+    status = USART0.RXDATAH;
+    data = USART0.RXDATAL;
+
+    now = RTC.CNT;
+    if ((uint16_t)(now - rx_last) > HAL_LN_MS(LNRX_TIMEOUT_MS))
+        flags |= RXB_GAP;
+    rx_last = now;
+
+    if (status & USART_FERR_bm)
+        flags |= RXB_FERR;
+
+#if !defined(LNECHO) || defined(LNTXVERIFY)
+    if (PORTA.IN & PIN4_bm)     // XDIR
+    {
+        flags |= RXB_ECHO;
+#ifdef LNTXVERIFY
+        // Compare echo with sent data
+        if ((status & USART_FERR_bm) || tx_echo_idx >= tx_len || data != tx_sent[tx_echo_idx & 0x03])
+            tx_echo_err = true;
+        tx_echo_idx++;
+#endif
+    }
+#endif
+
+#ifdef LNRXSPLIT
+    // Only store byte, framing is done by hal_ln_update
+    head = rxb_head;
+
+    if ((uint8_t)(head - rxb_tail) >= LNRXSPLIT_SIZE)
+    {
+        lost = RXB_LOST;
+#ifdef LNSTAT
+        stat.rx_overrun++;
+#endif
+        return;
+    }
+    rxb_data[head & (LNRXSPLIT_SIZE - 1)] = data;
+    rxb_flags[head & (LNRXSPLIT_SIZE - 1)] = flags | lost;
+    rxb_head = head + 1;
+    lost = 0;
+    pending |= HAL_LN_EV_UPDATE;
+#else
+    rx_byte(flags, data);
+#endif
+}
+
+#ifdef LNRXSPLIT
+/*
+ * Framing of bytes in rx byte ring.
+ */
+static void rx_split_update(void)
+{
+    uint8_t         tail = rxb_tail;
+
+    while (tail != rxb_head)
+    {
+        rx_byte(rxb_flags[tail & (LNRXSPLIT_SIZE - 1)], rxb_data[tail & (LNRXSPLIT_SIZE - 1)]);
+        rxb_tail = ++tail;
+    }
+}
+#endif
+
+__attribute__((flatten)) ISR(USART0_RXC_vect)
+{
+    CYCLES_ISR_START();
+    usart_rxc();
+    CYCLES_ISR_END(HAL_LN_CYC_RXC);
+}
+
 lnpacket_t     *hal_ln_receive(void)
 {
     fifo_t         *p;
+    lnpacket_t     *lnpacket = NULL;
+
+    CYCLES_API_START();
+
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+    {
+        p = fifo_queue_get(&queue_rx);
+        if (p)
+            rx_cnt--;
+        if (!queue_rx.head)
+            pending &= ~HAL_LN_EV_RX;
+    }
 
-    p = fifo_queue_get(&queue_rx);
     if (p)
-        return &PACKET_FROM_FIFO(p)->lndata;
-    return NULL;
+    {
+        lnpacket = &PACKET_FROM_FIFO(p)->lndata;
+#ifdef LNPROFILE
+        prof_count(lnpacket, false);
+#endif
+#ifdef LNBUSMON
+        bus_packet(PACKET_FROM_FIFO(p));
+#endif
+    }
+
+    CYCLES_API_END(HAL_LN_CYC_RECEIVE);
+
+    return lnpacket;
 }
 
 
@@ -520,6 +2091,17 @@ void hal_ln_init(void)
     // Init analog comparator and configurable logic
     ac_init();
     ccl_init();
+    rtc_init();
+
+#if defined(LNCYCLES) || defined(LNTRACE)
+    // Free running cycle counter
+    LNCYCLES_TCB.CCMP = 0xffff;
+    LNCYCLES_TCB.CTRLB = TCB_CNTMODE_INT_gc;
+    LNCYCLES_TCB.CTRLA = TCB_CLKSEL_DIV1_gc | TCB_ENABLE_bm;
+#endif
+#ifdef LNTRACE_VPORT
+    LNTRACE_VPORT.DIR |= LNTRACE_bm;
+#endif
 
     // Init USART pins
     PORTA.DIRCLR = PIN1_bm;     // RX input
@@ -534,16 +2116,313 @@ void hal_ln_init(void)
     USART0.EVCTRL = 0;
     USART0.STATUS = USART_RXCIF_bm | USART_TXCIF_bm;    // Clear interrupt flags
     USART0.CTRLB = USART_RXEN_bm | USART_TXEN_bm | USART_RXMODE_NORMAL_gc;
+#ifdef LNSFD
+    // Start-of-frame detection: Wake from standby on start bit
+    USART0.CTRLB |= USART_SFDEN_bm;
+    USART0.CTRLA |= USART_RXSIE_bm;
+#endif
 
     // Init packet queue
     for (uint8_t i = 0; i < LNPACKET_CNT; i++)
         fifo_queue_put(&queue_free, &packets[i].fifo);
+    free_cnt = LNPACKET_CNT;
+}
+
+uint16_t hal_ln_time(void)
+{
+    return rtc_cnt();
+}
+
+/************************************************************************/
+/* Bus monitor                                                          */
+/************************************************************************/
+
+#ifdef LNBUSMON
+
+/**
+ * Time in ms the line must be continuously low (with no bytes received) to
+ * be stuck.
+ */
+#ifndef LNBUSMON_STUCK_MS
+#define LNBUSMON_STUCK_MS   100
+#endif
+
+/**
+ * Number of packets in a row failing all tx attempts before bus is dead.
+ */
+#ifndef LNBUSMON_FAIL_CNT
+#define LNBUSMON_FAIL_CNT   3
+#endif
+
+/**
+ * Time in ms between probe packets when bus is dead.
+ */
+#ifndef LNBUSMON_PROBE_MS
+#define LNBUSMON_PROBE_MS   1000
+#endif
+
+/**
+ * Bus state flags that hold back tx.
+ */
+#ifndef LNBUSMON_GATE
+#define LNBUSMON_GATE   (HAL_LN_BUS_POWER_OFF | HAL_LN_BUS_STUCK | HAL_LN_BUS_DEAD)
+#endif
+
+static uint8_t  bus_state;
+static uint16_t bus_probe;
+static bool     bus_low;        // Line seen low at last check
+static uint16_t bus_low_time;   // Time line was first seen low
+static uint16_t bus_low_rx;     // Time of last received byte at that time
+
+/*
+ * Set or clear bus state flag.
+ */
+static void bus_set(uint8_t flag, bool on)
+{
+    if (!on)
+    {
+        bus_state &= ~flag;
+        return;
+    }
+
+    if (bus_state & flag)
+        return;
+
+    bus_state |= flag;
+#ifdef LNSTAT
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+    {
+        if (flag == HAL_LN_BUS_POWER_OFF)
+            stat.bus_power_off++;
+        else if (flag == HAL_LN_BUS_STUCK)
+            stat.bus_stuck++;
+        else
+            stat.bus_dead++;
+    }
+#endif
+}
+
+/*
+ * Track power state from sent or received packet.
+ */
+static void bus_packet(const packet_t *packet)
+{
+    uint8_t         op = packet_op(packet);
+
+    if (op == OPC_GPON)
+    {
+        if (bus_state & HAL_LN_BUS_POWER_OFF)
+            pending_set(HAL_LN_EV_UPDATE);      // Resume tx held back
+        bus_set(HAL_LN_BUS_POWER_OFF, false);
+    }
+    else if (op == OPC_GPOFF)
+        bus_set(HAL_LN_BUS_POWER_OFF, true);
+}
+
+/*
+ * Check line and tx failures.
+ * TCB2 stops on every low bit, so the line is only stuck if it has been
+ * seen low on every check for LNBUSMON_STUCK_MS, with no bytes received
+ * in between (any traffic ends with a received byte, framing error or not).
+ */
+static void bus_update(void)
+{
+    uint16_t        now = hal_ln_time();
+    uint16_t        last;
+
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+    {
+        last = rx_last;
+    }
+
+    if (TCB2.STATUS & TCB_RUN_bm)       // Line idle (high)
+    {
+        bus_low = false;
+        bus_set(HAL_LN_BUS_STUCK, false);
+    }
+    else if (!bus_low || last != bus_low_rx)
+    {
+        // First seen low, or bytes received since: Start over
+        bus_low = true;
+        bus_low_time = now;
+        bus_low_rx = last;
+    }
+    else if ((uint16_t)(now - bus_low_time) > HAL_LN_MS(LNBUSMON_STUCK_MS))
+    {
+        bus_set(HAL_LN_BUS_STUCK, true);
+    }
+
+    bus_set(HAL_LN_BUS_DEAD, bus_fails >= LNBUSMON_FAIL_CNT);
 }
 
+/*
+ * Check if packet at head of tx queue may be sent.
+ * With LNBUSMON_FAILFAST, packets that may not be sent are failed instead.
+ */
+static bool bus_tx_allowed(void)
+{
+    packet_t       *packet;
+    uint8_t         op;
+    uint8_t         gate = bus_state & LNBUSMON_GATE;
+
+    if (!gate)
+        return true;
+
+    for (;;)
+    {
+        ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+        {
+            packet = queue_tx.head ? PACKET_FROM_FIFO(queue_tx.head) : NULL;
+        }
+        if (!packet)
+            return false;
+
+        op = packet_op(packet);
+        if (op == OPC_GPON || op == OPC_GPOFF || op == OPC_IDLE || op == OPC_BUSY)
+            return true;
+
+        if (gate == HAL_LN_BUS_DEAD && (uint16_t)(hal_ln_time() - bus_probe) >= HAL_LN_MS(LNBUSMON_PROBE_MS))
+        {
+            bus_probe = hal_ln_time();
+            return true;        // Probe if bus is back
+        }
+
+#ifdef LNBUSMON_FAILFAST
+        fifo_queue_get(&queue_tx);
+        packet->res = HAL_LN_FAIL;
+#ifdef LNSTAT
+        ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+        {
+            stat.tx_gated++;
+        }
+#endif
+        queue_put_done(packet);
+#else
+        return false;
+#endif
+    }
+}
+
+/*
+ * Fail loaded packet that waits for CD BACKOFF while line is stuck.
+ * TCB2 doesn't run while the line is low, so the packet would never start,
+ * and tx_watch can't time it out. The tx queue is then handled by
+ * bus_tx_allowed.
+ */
+static void bus_tx_abort(void)
+{
+    if (!(bus_state & HAL_LN_BUS_STUCK))
+        return;
+
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+    {
+        if (tx_buf && (TCB2.INTCTRL & TCB_CAPT_bm))
+        {
+            TCB2.INTCTRL = 0;   // Disable capture interrupt
+            TCB2.INTFLAGS = TCB_CAPT_bm;
+            TRACE(TR_TX_END, 2);
+            tx_buf->res = HAL_LN_FAIL;
+#ifdef LNSTAT
+            stat.tx_gated++;
+#endif
+            queue_put_done(tx_buf);
+            tx_buf = NULL;
+        }
+    }
+}
+
+uint8_t hal_ln_bus_state(void)
+{
+    return bus_state;
+}
+
+#endif
+
+
 void hal_ln_update(void)
 {
+    CYCLES_API_START();
+
+#ifdef LNBUSMON
+    bus_update();
+#endif
+    sched_update();
+    tx_watch();
     tx_update();
     tx_done_update();
+#ifdef LNRXSPLIT
+    rx_split_update();
+#endif
+    rx_scratch_update();
+
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+    {
+        bool            tx_wait = queue_tx.head && !tx_buf;
+        bool            rx_wait = rx_scratch_full;
+
+        if (sched_cmp_wait)
+            tx_wait = true;     // RTC compare not set yet
+
+#ifdef LNBUSMON
+        // Tx held back by track power off is resumed by a GPON (sent or
+        // received, see bus_packet), no polling needed
+        if ((bus_state & LNBUSMON_GATE) == HAL_LN_BUS_POWER_OFF)
+            tx_wait = false;
+#endif
+        // Wake up periodically for tx stall supervision while transmitting
+        RTC.PITINTCTRL = tx_buf ? RTC_PI_bm : 0;
+#ifdef LNRXSPLIT
+        if (rxb_head != rxb_tail)
+            rx_wait = true;     // More bytes received while framing
+#endif
+
+        // Clear flag if there is nothing more to do right now
+        if (!queue_done.head && !tx_wait && !rx_wait)
+            pending &= ~HAL_LN_EV_UPDATE;
+    }
+
+    CYCLES_API_END(HAL_LN_CYC_UPDATE);
+}
+
+uint8_t hal_ln_pending(void)
+{
+    return pending;
+}
+
+static bool     wake_tick;     // Timed wakeup requested
+
+void hal_ln_wake_tick(void)
+{
+    wake_tick = true;
+}
+
+void hal_ln_wait(void)
+{
+#ifdef LNSFD
+    // Standby stops the CD BACKOFF timer, so only use it when not transmitting
+    if (tx_buf || queue_tx.head)
+        set_sleep_mode(SLEEP_MODE_IDLE);
+    else
+        set_sleep_mode(SLEEP_MODE_STANDBY);
+#else
+    set_sleep_mode(SLEEP_MODE_IDLE);
+#endif
+
+    cli();
+    if (wake_tick)
+    {
+        // Disabled again by hal_ln_update, unless transmitting
+        RTC.PITINTCTRL = RTC_PI_bm;
+        wake_tick = false;
+    }
+    if (!pending)
+    {
+        sleep_enable();
+        sei();                  // Next instruction is executed before any interrupt
+        sleep_cpu();
+        sleep_disable();
+    }
+    sei();
 }
 
 
@@ -555,18 +2434,24 @@ void hal_ln_update(void)
 
 #include "avr-shell-cmd/cmd.h"
 
-#ifdef LNSTAT
-#include <string.h>
-#endif
-
 static void lnCmd(uint8_t argc, char *argv[])
 {
     if (argc < 2)
     {
         printf_P(PSTR("Missing argument\nArguments:\n"));
+        printf_P(PSTR(" c - Clock and timing\n"));
         printf_P(PSTR(" i <adr> <0/1> - Send input rep (feedback)\n"));
 #ifdef LNSTAT
         printf_P(PSTR(" s[r] - Stat. r=reset\n"));
+#endif
+#ifdef LNPROFILE
+        printf_P(PSTR(" p[r] - Traffic profile. r=reset\n"));
+#endif
+#ifdef LNCYCLES
+        printf_P(PSTR(" y[r] - Cycles per interrupt and API call. r=reset\n"));
+#endif
+#ifdef LNTRACE
+        printf_P(PSTR(" x - Trace dump (decode with tools/lntrace.py)\n"));
 #endif
         printf_P(PSTR(" t <data1> [<datan>] - Tx packet\n"));
         return;
@@ -574,6 +2459,14 @@ static void lnCmd(uint8_t argc, char *argv[])
 
     switch (argv[1][0])
     {
+    case 'c':
+        printf_P(PSTR("F_CPU:         %lu Hz\n"), (uint32_t)F_CPU);
+        printf_P(PSTR("Baud reg:      %u (%ld ppm)\n"), (uint16_t)BAUD_REG, (int32_t)BAUD_ERR_PPM);
+        printf_P(PSTR("1/4 bit:       %u cycles (%ld ppm)\n"), (uint16_t)TCB0_CCMP_VAL, (int32_t)TIME_ERR_PPM(TCB0_CCMP_VAL, 15));
+        printf_P(PSTR("BREAK:         %u cycles (%ld ppm)\n"), (uint16_t)TCB1_CCMP_VAL, (int32_t)TIME_ERR_PPM(TCB1_CCMP_VAL, 60 * 15));
+        printf_P(PSTR("CD tick:       %u cycles\n"), (uint16_t)(TCA0_PER_VAL + 1));
+        break;
+
     case 'i':
         {
             lnpacket_t     *txdata;
@@ -640,6 +2533,90 @@ static void lnCmd(uint8_t argc, char *argv[])
             break;
         }
 
+#ifdef LNTRACE
+    case 'x':
+        {
+            bool            stop = trace_stop;
+
+            trace_stop = true;
+            printf_P(PSTR("trace %lu %u\n"), (uint32_t)F_CPU, HAL_LN_TICK_HZ);
+            for (uint16_t i = 0; i < LNTRACE_CNT; i++)
+            {
+                trace_t        *t = &trace_buf[(trace_idx + i) & (LNTRACE_CNT - 1)];
+
+                if (t->ev)
+                    printf_P(PSTR("%u %u %u %u\n"), t->ev, t->arg, t->tick, t->cyc);
+            }
+            printf_P(PSTR("end\n"));
+            trace_stop = stop;
+        }
+        break;
+#endif
+
+#ifdef LNCYCLES
+    case 'y':
+        if (argv[1][1] == 'r')
+        {
+            hal_ln_cycles_reset();
+            printf_P(PSTR("Cycles reset\n"));
+        }
+        else
+        {
+            static const __flash char names[HAL_LN_CYC_CNT][8] = {
+                "RXC", "TXC", "DRE", "TCB2", "RTC", "send", "receive", "update", "rxdisp"
+            };
+            hal_ln_cycles_t c;
+
+            printf_P(PSTR("Name       max    avg    cnt budget\n"));
+            for (uint8_t id = 0; id < HAL_LN_CYC_CNT; id++)
+            {
+                hal_ln_cycles(id, &c);
+                printf_P(PSTR("%-7S %6u %6u %6u %6u%S\n"), names[id], c.max, c.avg, c.cnt, c.budget,
+                         (c.budget && c.max > c.budget) ? PSTR(" FAIL") : PSTR(""));
+            }
+            printf_P(PSTR("%u over budget\n"), hal_ln_cycles_check());
+        }
+        break;
+#endif
+
+#ifdef LNPROFILE
+    case 'p':
+        if (argv[1][1] == 'r')
+        {
+            hal_ln_profile_reset();
+            printf_P(PSTR("Profile reset\n"));
+        }
+        else
+        {
+            hal_ln_talker_t t[LNPROFILE_TALKERS];
+            uint8_t         cnt;
+
+            printf_P(PSTR("Opcode     rx     tx\n"));
+            for (uint8_t i = 0; i < PROF_OPC_CNT; i++)
+            {
+                uint16_t        rx, tx;
+
+                ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+                {
+                    rx = prof_rx[i];
+                    tx = prof_tx[i];
+                }
+                if (!rx && !tx)
+                    continue;
+                if (i < sizeof(prof_opc))
+                    printf_P(PSTR("  0x%02x %6u %6u\n"), prof_opc[i], rx, tx);
+                else
+                    printf_P(PSTR("  other %5u %6u\n"), rx, tx);
+            }
+
+            cnt = hal_ln_profile_talkers(t, LNPROFILE_TALKERS);
+            printf_P(PSTR("Top talkers:\n"));
+            for (uint8_t i = 0; i < cnt; i++)
+                printf_P(PSTR("  %c %5u %6u\n"), t[i].type, t[i].adr, t[i].cnt);
+        }
+        break;
+#endif
+
 #ifdef LNSTAT
     case 's':
         {
@@ -647,23 +2624,21 @@ static void lnCmd(uint8_t argc, char *argv[])
 
             if (argv[1][1] == 'r')
             {
-                ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
-                {
-                    memset(&stat, 0, sizeof(stat));
-                }
+                hal_ln_stat_get(NULL, true);
                 printf_P(PSTR("Statistics reset\n"));
             }
             else
             {
-                ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
-                {
-                    s = stat;
-                }
+                hal_ln_stat_get(&s, false);
                 printf_P(PSTR("TX:\n"));
                 printf_P(PSTR(" Packets scheduled:  %u\n"), s.tx_total);
                 printf_P(PSTR(" Packets sent:       %u\n"), s.tx_success);
                 printf_P(PSTR(" Packets tx fail:    %u\n"), s.tx_fail);
+                printf_P(PSTR(" Tx stalls reset:    %u\n"), s.tx_stall);
                 printf_P(PSTR(" Collisions:         %u\n"), s.tx_collisions);
+#ifdef LNTXVERIFY
+                printf_P(PSTR(" Echo errors:        %u\n"), s.tx_echo_err);
+#endif
                 printf_P(PSTR(" Max attemps for tx: %u\n"), s.tx_max_attempts);
                 printf_P(PSTR("RX:\n"));
                 printf_P(PSTR(" Packets received:   %u\n"), s.rx_success);
@@ -672,12 +2647,30 @@ static void lnCmd(uint8_t argc, char *argv[])
                 printf_P(PSTR(" Partial packets:    %u\n"), s.rx_partial);
                 printf_P(PSTR(" Extra bytes:        %u\n"), s.rx_extradata);
                 printf_P(PSTR(" Collisions:         %u\n"), s.rx_collisions);
+                printf_P(PSTR(" Zero byte FERRs:    %u\n"), s.rx_ferr_zero);
+                printf_P(PSTR(" Timeouts:           %u\n"), s.rx_timeout);
                 printf_P(PSTR(" No memory:          %u\n"), s.rx_nomem);
+                printf_P(PSTR(" Over rx quota:      %u\n"), s.rx_quota);
+                printf_P(PSTR(" Saved by scratch:   %u\n"), s.rx_scratch);
+#ifdef LNRXSPLIT
+                printf_P(PSTR(" Byte ring overrun:  %u\n"), s.rx_overrun);
+#endif
                 printf_P(PSTR("Mem:\n"));
                 printf_P(PSTR(" Free packets:       %u\n"), fifo_queue_size(&queue_free));
+                printf_P(PSTR(" Rx reserved:        %u\n"), LNPACKET_RX_RESERVE);
+                printf_P(PSTR(" Denied by reserve:  %u\n"), s.pool_denied);
+                printf_P(PSTR(" Rx scratch in use:  %u\n"), rx_scratch_full);
                 printf_P(PSTR(" In tx queue:        %u\n"), fifo_queue_size(&queue_tx));
                 printf_P(PSTR(" In rx queue:        %u\n"), fifo_queue_size(&queue_rx));
                 printf_P(PSTR(" In done queue:      %u\n"), fifo_queue_size(&queue_done));
+#ifdef LNBUSMON
+                printf_P(PSTR("Bus:\n"));
+                printf_P(PSTR(" State:              0x%02x\n"), hal_ln_bus_state());
+                printf_P(PSTR(" Power off:          %u\n"), s.bus_power_off);
+                printf_P(PSTR(" Stuck:              %u\n"), s.bus_stuck);
+                printf_P(PSTR(" Dead:               %u\n"), s.bus_dead);
+                printf_P(PSTR(" Tx gated:           %u\n"), s.tx_gated);
+#endif
             }
             break;
         }
@@ -14,6 +14,11 @@
 #include <stdio.h>
 #include "ln_def.h"
 
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
 
 /**
  * Callback result codes
@@ -21,7 +26,8 @@
 typedef enum
 {
     HAL_LN_SUCCESS,
-    HAL_LN_FAIL
+    HAL_LN_FAIL,
+    HAL_LN_TIMEOUT              // Tx stalled and was reset (see LNTX_STALL_MS)
 } hal_ln_result_t;
 
 /**
@@ -29,6 +35,23 @@ typedef enum
  */
 typedef void    (hal_ln_tx_done_cb_t) (void *ctx, hal_ln_result_t res);
 
+/**
+ * Library time base frequency in Hz (see hal_ln_time).
+ */
+#define HAL_LN_TICK_HZ  1024
+
+/**
+ * Convert milliseconds to library time base ticks (rounded up).
+ */
+#define HAL_LN_MS(ms)   ((uint16_t)(((uint32_t)(ms) * HAL_LN_TICK_HZ + 999) / 1000))
+
+/**
+ * Pending work flags (see hal_ln_pending).
+ */
+#define HAL_LN_EV_RX        0x01        // Received packet ready (hal_ln_receive)
+#define HAL_LN_EV_UPDATE    0x02        // Work for hal_ln_update
+#define HAL_LN_EV_DIRECT    0x04        // Received packet ready in direct rx ring
+
 /**
  * Init LocoNet library.
  *
@@ -90,6 +113,139 @@ extern uint8_t  hal_ln_packet_len(const lnpacket_t *p);
  */
 extern void     hal_ln_send(lnpacket_t *lnpacket, hal_ln_tx_done_cb_t * cb, void *ctx);
 
+/**
+ * Send prepared LocoNet packet.
+ *
+ * Like hal_ln_send, but the LocoNet packet must already be complete,
+ * including a valid checksum, with bit 7 cleared in all bytes except the
+ * opcode, and no longer than LNPACKET_SIZE_MAX. No bytes are masked, the
+ * length is not checked and the checksum is sent as it is (used by the
+ * packet builders in ln_tx.hpp).
+ *
+ * @param lnpacket Pointer to LocoNet packet to send.
+ *                 LocoNet packet is freed by function.
+ * @param cb       Callback function for packet sent notification.
+ *                 Set to NULL if not used.
+ * @param ctx      Pointer to context data, that will be passed on to
+ *                 the callback function.
+ */
+extern void     hal_ln_send_prepared(lnpacket_t *lnpacket, hal_ln_tx_done_cb_t * cb, void *ctx);
+
+/**
+ * Fragment of zero-copy transfer (see hal_ln_send_xfer).
+ */
+typedef struct
+{
+    const uint8_t  *data;       // Fragment data
+    uint8_t         len;        // Fragment length
+} hal_ln_frag_t;
+
+/**
+ * Size of library private part of hal_ln_xfer_t.
+ */
+#define HAL_LN_XFER_PRIV    (10 * sizeof(void *))
+
+/**
+ * Zero-copy transfer descriptor (see hal_ln_send_xfer).
+ */
+typedef struct
+{
+    uint8_t         priv[HAL_LN_XFER_PRIV];     // Used by library
+    const hal_ln_frag_t *frag;  // Fragments, sent in order
+    uint8_t         cnt;        // Number of fragments
+} hal_ln_xfer_t;
+
+/**
+ * Send LocoNet packet from caller owned buffers (zero-copy).
+ *
+ * The packet is sent directly from the fragments in xfer (e.g. a header and
+ * a payload), without using a packet from the pool. The fragments must
+ * together hold a complete LocoNet packet without the checksum, with
+ * bit 7 cleared in all bytes except the opcode, and a length matching the
+ * opcode (and its length byte). Other packets are not sent, and fail.
+ * The checksum is calculated while sending. Packets longer than
+ * LNPACKET_SIZE_MAX can be sent.
+ * The descriptor, the fragment array and the data must be left untouched
+ * until the callback has been called. Then they belong to the caller again.
+ * Otherwise works like hal_ln_send.
+ *
+ * @param xfer Transfer descriptor, with frag and cnt set.
+ * @param cb   Callback function for packet sent notification.
+ *             Set to NULL if not used.
+ * @param ctx  Pointer to context data, that will be passed on to
+ *             the callback function.
+ */
+extern void     hal_ln_send_xfer(hal_ln_xfer_t *xfer, hal_ln_tx_done_cb_t * cb, void *ctx);
+
+/**
+ * Send group of LocoNet packets.
+ *
+ * The packets are queued as one unit and sent in order, back-to-back.
+ * Once a packet in the group has been sent, the next one is started at
+ * minimum CD BACKOFF, and no other queued packet is sent in between.
+ * If a packet in the group can not be sent, the rest of the group is
+ * dropped and the group fails.
+ * Otherwise works like hal_ln_send.
+ *
+ * @param lnpacket Array of pointers to LocoNet packets to send.
+ *                 LocoNet packets are freed by function.
+ *                 The array itself is not needed after the call.
+ * @param cnt      Number of LocoNet packets in array.
+ * @param cb       Callback function for group sent notification.
+ *                 Called once, when the whole group is done.
+ *                 Set to NULL if not used.
+ * @param ctx      Pointer to context data, that will be passed on to
+ *                 the callback function.
+ */
+extern void     hal_ln_send_group(lnpacket_t *lnpacket[], uint8_t cnt, hal_ln_tx_done_cb_t * cb, void *ctx);
+
+/**
+ * Send LocoNet packet at a given time.
+ *
+ * LocoNet packet is held back, and put in the tx queue when the time
+ * is reached (from interrupt, no polling needed).
+ * Otherwise works like hal_ln_send.
+ *
+ * @param lnpacket Pointer to LocoNet packet to send.
+ *                 LocoNet packet is freed by function.
+ * @param time     Time to send packet (see hal_ln_time).
+ *                 Must be less than 32 seconds into the future.
+ * @param cb       Callback function for packet sent notification.
+ *                 Set to NULL if not used.
+ * @param ctx      Pointer to context data, that will be passed on to
+ *                 the callback function.
+ */
+extern void     hal_ln_send_at(lnpacket_t *lnpacket, uint16_t time, hal_ln_tx_done_cb_t * cb, void *ctx);
+
+/**
+ * Send LocoNet packet periodically.
+ *
+ * LocoNet packet is sent every period ticks, first time one period from now.
+ * The same packet is reused for every transmission, and is not freed until
+ * cancelled with hal_ln_send_cancel. The callback is called after every
+ * transmission. Do not change packet data while it is scheduled.
+ *
+ * @param lnpacket Pointer to LocoNet packet to send.
+ * @param period   Time between transmissions in ticks (see hal_ln_time).
+ *                 Must be less than 32 seconds.
+ * @param cb       Callback function for packet sent notification.
+ *                 Set to NULL if not used.
+ * @param ctx      Pointer to context data, that will be passed on to
+ *                 the callback function.
+ */
+extern void     hal_ln_send_every(lnpacket_t *lnpacket, uint16_t period, hal_ln_tx_done_cb_t * cb, void *ctx);
+
+/**
+ * Cancel scheduled or periodic LocoNet packet.
+ *
+ * The packet is freed. If it is already on its way through the tx queue,
+ * it is sent one last time before it is freed.
+ *
+ * @param lnpacket Pointer to LocoNet packet given to hal_ln_send_at or
+ *                 hal_ln_send_every.
+ */
+extern void     hal_ln_send_cancel(lnpacket_t *lnpacket);
+
 /**
  * Receive LocoNet packet.
  *
@@ -101,6 +257,306 @@ extern void     hal_ln_send(lnpacket_t *lnpacket, hal_ln_tx_done_cb_t * cb, void
  */
 extern lnpacket_t *hal_ln_receive(void);
 
+/**
+ * Direct rx ring (see hal_ln_rx_direct).
+ */
+typedef struct
+{
+    uint8_t        *buf;        // cnt entries of size bytes each
+    uint8_t         size;       // Entry size: Max packet length incl. checksum (min 2)
+    uint8_t         cnt;        // Number of entries. Must be a power of 2
+    volatile uint8_t head;      // Used by library
+    volatile uint8_t tail;      // Used by library
+    volatile uint16_t drop;     // Packets dropped because they were too large
+    volatile uint16_t overflow; // Packets passed on to hal_ln_receive, ring full
+} hal_ln_rx_ring_t;
+
+/**
+ * Receive packets with opcode directly into ring (requires LNRXDIRECT).
+ *
+ * Received packets with the opcode are written directly into the ring by
+ * the rx interrupt, and are not put in the rx queue. No pool packet is used.
+ * If the ring is full, the packet is received as usual (hal_ln_receive).
+ * Set buf, size and cnt before registering. head and tail must be 0.
+ *
+ * @param op   Opcode.
+ * @param ring Ring to receive into, or NULL to stop direct reception of op.
+ * @return     true on success, false if too many opcodes are registered
+ *             (LNRXDIRECT_CNT) or the ring is invalid.
+ */
+extern bool     hal_ln_rx_direct(uint8_t op, hal_ln_rx_ring_t *ring);
+
+/**
+ * Get oldest packet in direct rx ring (requires LNRXDIRECT).
+ *
+ * Only the first ring->size bytes of the packet are valid.
+ * The packet stays in the ring until released with hal_ln_rx_ring_free.
+ *
+ * @param ring Ring.
+ * @return     Pointer to packet, or NULL if ring is empty.
+ */
+extern lnpacket_t *hal_ln_rx_ring_get(hal_ln_rx_ring_t *ring);
+
+/**
+ * Release oldest packet in direct rx ring (requires LNRXDIRECT).
+ *
+ * @param ring Ring.
+ */
+extern void     hal_ln_rx_ring_free(hal_ln_rx_ring_t *ring);
+
+/**
+ * Get library time.
+ *
+ * Free running time base, counting at HAL_LN_TICK_HZ (approx. 1 ms).
+ * The counter wraps around, so only use differences between two values,
+ * e.g. (int16_t)(hal_ln_time() - t) >= 0 to test if time t has been reached.
+ *
+ * @return Current time in ticks.
+ */
+extern uint16_t hal_ln_time(void);
+
+/**
+ * Get pending work.
+ *
+ * Flags are set from interrupts when there is work for the mainloop, and
+ * cleared when the work has been done (rx queue empty, or nothing more
+ * for hal_ln_update to do).
+ *
+ * @return Pending work flags (HAL_LN_EV_xxx), or 0 if nothing to do.
+ */
+extern uint8_t  hal_ln_pending(void);
+
+/**
+ * Sleep until there is LocoNet work to do.
+ *
+ * Returns immediately if work is pending, otherwise the CPU sleeps until
+ * an interrupt. Any interrupt (also from outside the library) wakes up the
+ * CPU, so the caller must check for its own work as well.
+ * While a packet is being transmitted, or if hal_ln_wake_tick has been
+ * called since the last wait, the RTC periodic interrupt wakes up the CPU
+ * within 15.6 ms (tx is supervised by hal_ln_update, see LNTX_STALL_MS).
+ * Nothing else wakes up the CPU for time based work, so modules with
+ * timeouts must call hal_ln_wake_tick while they have any (ln_route,
+ * ln_input, ln_prog and ln_stat do so from their update functions).
+ * Uses idle sleep mode. If LNSFD is defined, standby sleep mode is used
+ * when nothing is being transmitted, and the start bit of an incoming byte
+ * wakes up the CPU.
+ *
+ * Typical mainloop:
+ *   for (;;) { hal_ln_wait(); hal_ln_update(); ln_rx_update(); }
+ */
+extern void     hal_ln_wait(void);
+
+/**
+ * Request a timed wakeup from the next hal_ln_wait.
+ *
+ * The CPU is woken up within 15.6 ms (RTC periodic interrupt). Call on
+ * every pass of the mainloop while time based work is pending.
+ */
+extern void     hal_ln_wake_tick(void);
+
+/**
+ * Top talker types.
+ */
+#define HAL_LN_TALKER_SW    'S' // Switch address (OPC_SW_xxx)
+#define HAL_LN_TALKER_INPUT 'I' // Input address (OPC_INPUT_REP)
+#define HAL_LN_TALKER_SLOT  'L' // Slot number (loco and slot opcodes)
+
+/**
+ * Top talker table entry.
+ */
+typedef struct
+{
+    uint8_t         type;       // HAL_LN_TALKER_xxx
+    uint16_t        adr;        // Address or slot
+    uint16_t        cnt;        // Packets (rx and tx)
+} hal_ln_talker_t;
+
+/**
+ * Get traffic profile counter for opcode (requires LNPROFILE).
+ *
+ * Packets are counted when read with hal_ln_receive, and when sent successfully.
+ *
+ * @param op Opcode. Opcodes not in ln_def.h share one counter.
+ * @param tx true for tx counter, false for rx counter.
+ * @return   Number of packets.
+ */
+extern uint16_t hal_ln_profile_opc(uint8_t op, bool tx);
+
+/**
+ * Get top talker table (requires LNPROFILE).
+ *
+ * The table holds the most frequent addresses (approximately) for switch,
+ * input and slot traffic.
+ *
+ * @param t   Array to copy table entries to.
+ * @param max Max number of entries in array.
+ * @return    Number of entries copied.
+ */
+extern uint8_t  hal_ln_profile_talkers(hal_ln_talker_t *t, uint8_t max);
+
+/**
+ * Reset traffic profile (requires LNPROFILE).
+ */
+extern void     hal_ln_profile_reset(void);
+
+/**
+ * Cycle measurement points (see hal_ln_cycles).
+ */
+enum
+{
+    HAL_LN_CYC_RXC,             // USART0 rx complete interrupt
+    HAL_LN_CYC_TXC,             // USART0 tx complete interrupt
+    HAL_LN_CYC_DRE,             // USART0 data register empty interrupt
+    HAL_LN_CYC_TCB2,            // CD BACKOFF timer interrupt
+    HAL_LN_CYC_RTC,             // Scheduled tx interrupt
+    HAL_LN_CYC_SEND,            // hal_ln_send
+    HAL_LN_CYC_RECEIVE,         // hal_ln_receive
+    HAL_LN_CYC_UPDATE,          // hal_ln_update
+    HAL_LN_CYC_DISPATCH,        // ln_rx_update dispatch (including handlers)
+    HAL_LN_CYC_CNT
+};
+
+/**
+ * Cycle measurement result.
+ */
+typedef struct
+{
+    uint16_t        max;        // Worst case cycles
+    uint16_t        avg;        // Average cycles
+    uint16_t        cnt;        // Number of measurements
+    uint16_t        budget;     // Max allowed cycles, 0 if not checked
+} hal_ln_cycles_t;
+
+/**
+ * Get cycle measurement (requires LNCYCLES).
+ *
+ * Interrupts are measured from first to last statement (excluding
+ * register save and restore). API calls are measured without the time
+ * spent in the library interrupts.
+ * The timer is 16 bit and overflows are not counted, so a measurement
+ * wraps if it takes more than 65536 cycles (approx. 2.7 ms at 24 MHz).
+ *
+ * @param id Measurement point (HAL_LN_CYC_xxx).
+ * @param c  Result.
+ */
+extern void     hal_ln_cycles(uint8_t id, hal_ln_cycles_t *c);
+
+/**
+ * Check cycle measurements against budgets (requires LNCYCLES).
+ *
+ * @return Number of measurement points where worst case exceeds the budget.
+ */
+extern uint8_t  hal_ln_cycles_check(void);
+
+/**
+ * Reset cycle measurements (requires LNCYCLES).
+ */
+extern void     hal_ln_cycles_reset(void);
+
+/**
+ * Start cycle measurement of code outside the library (requires LNCYCLES).
+ *
+ * Only one such measurement can run at a time, and only from mainloop.
+ * Time spent in the library interrupts is excluded, like for API calls.
+ */
+extern void     hal_ln_cycles_begin(void);
+
+/**
+ * End cycle measurement started by hal_ln_cycles_begin (requires LNCYCLES).
+ *
+ * @param id Measurement point (HAL_LN_CYC_xxx) to add the result to.
+ */
+extern void     hal_ln_cycles_end(uint8_t id);
+
+/**
+ * Stop or restart trace recording (requires LNTRACE).
+ *
+ * Stop recording when a fault is detected, to keep the events leading up to
+ * it for later dump with shell cmd "ln x".
+ *
+ * @param stop true to stop, false to restart.
+ */
+extern void     hal_ln_trace_stop(bool stop);
+
+/**
+ * Bus state flags (see hal_ln_bus_state).
+ */
+#define HAL_LN_BUS_POWER_OFF    0x01    // Track power off (OPC_GPOFF seen)
+#define HAL_LN_BUS_STUCK        0x02    // Line held low
+#define HAL_LN_BUS_DEAD         0x04    // Repeated tx failures (all attempts used)
+
+/**
+ * Get bus state (requires LNBUSMON).
+ *
+ * Track power follows OPC_GPON/OPC_GPOFF sent or read with hal_ln_receive.
+ * The line is checked from hal_ln_update. Tx failures are cleared by the
+ * next successful tx.
+ * While a flag in LNBUSMON_GATE is set, the tx queue is held back (or failed
+ * with LNBUSMON_FAILFAST), except OPC_GPON, OPC_GPOFF, OPC_IDLE and OPC_BUSY.
+ * When the bus is dead, one packet is tried every LNBUSMON_PROBE_MS.
+ *
+ * @return Bus state flags (HAL_LN_BUS_xxx), or 0 if bus is ok.
+ */
+extern uint8_t  hal_ln_bus_state(void);
+
+/**
+ * Library statistics (see hal_ln_stat_get).
+ */
+typedef struct
+{
+    uint8_t         tx_max_attempts;
+    uint16_t        tx_total;
+    uint16_t        tx_success;
+    uint16_t        tx_fail;
+    uint16_t        tx_collisions;
+    uint16_t        tx_echo_err;
+    uint16_t        rx_success;
+    uint16_t        rx_success_large;
+    uint16_t        rx_checksum;
+    uint16_t        rx_partial;
+    uint16_t        rx_extradata;
+    uint16_t        rx_collisions;
+    uint16_t        rx_ferr_zero;   // Framing errors with all zero byte (line low >= 10 bits)
+    uint16_t        rx_timeout;
+    uint16_t        rx_nomem;
+    uint16_t        rx_quota;
+    uint16_t        rx_scratch;
+    uint16_t        pool_denied;
+    uint16_t        bus_power_off;
+    uint16_t        bus_stuck;
+    uint16_t        bus_dead;
+    uint16_t        tx_gated;
+    uint16_t        rx_overrun;
+    uint16_t        tx_stall;
+} hal_ln_stat_t;
+
+/**
+ * Get library statistics (requires LNSTAT).
+ *
+ * @param s     Statistics copy. Set to NULL if not used.
+ * @param reset Reset statistics after copy.
+ */
+extern void     hal_ln_stat_get(hal_ln_stat_t *s, bool reset);
+
+/**
+ * Packet queue depths (see hal_ln_queues).
+ */
+typedef struct
+{
+    uint8_t         free;       // Free packets
+    uint8_t         tx;         // Packets waiting for tx
+    uint8_t         rx;         // Received packets not read yet
+    uint8_t         done;       // Sent packets waiting for callback
+} hal_ln_queues_t;
+
+/**
+ * Get packet queue depths.
+ *
+ * @param q Queue depths.
+ */
+extern void     hal_ln_queues(hal_ln_queues_t *q);
+
 /**
  * Get tx collision status.
  *
@@ -112,4 +568,8 @@ extern lnpacket_t *hal_ln_receive(void);
  */
 extern bool     hal_ln_tx_collision(void);
 
+#ifdef __cplusplus
+}
+#endif
+
 #endif /* HAL_LN_H_ */
@@ -48,6 +48,30 @@
 #define OPC_IMM_PACKET      0xed
 #define OPC_WR_SL_DATA      0xef
 
+/*
+ * Programmer task (slot 0x7c)
+ */
+#define LN_SLOT_PROG        0x7c
+#define LN_PROG_LEN         0x0e        // Length of OPC_WR_SL_DATA/OPC_SL_RD_DATA for programmer slot
+
+// PCMD bits
+#define LN_PCMD_WRITE       0x40        // Write (read if cleared)
+#define LN_PCMD_BYTE        0x20        // Byte mode
+#define LN_PCMD_OPS         0x04        // Ops mode (main track)
+#define LN_PCMD_FEEDBACK    0x08        // Direct mode (service track), or ops mode with feedback
+
+// PSTAT bits
+#define LN_PSTAT_NO_DECODER 0x01
+#define LN_PSTAT_NO_WR_ACK  0x02
+#define LN_PSTAT_NO_RD_ACK  0x04
+#define LN_PSTAT_ABORTED    0x08
+
+// OPC_LONG_ACK ACK1 for programmer task
+#define LN_PROG_ACK_BUSY    0x00        // Programmer busy, task not done
+#define LN_PROG_ACK_OK      0x01        // Task accepted, OPC_SL_RD_DATA follows
+#define LN_PROG_ACK_BLIND   0x40        // Task accepted, no reply follows
+#define LN_PROG_ACK_NOTIMPL 0x7f        // Not implemented
+
 /*
  * Largest size for a LocoNet package, including op and cksum.
  */
@@ -201,6 +225,27 @@ typedef struct
     uint8_t         adr;
 } lnpacket_loco_adr_t;
 
+/*
+ * LocoNet packet for OPC_WR_SL_DATA and OPC_SL_RD_DATA to/from the
+ * programmer slot (LN_SLOT_PROG).
+ */
+typedef struct
+{
+    uint8_t         op;
+    uint8_t         len;
+    uint8_t         slot;
+    uint8_t         pcmd;
+    uint8_t         pstat;
+    uint8_t         hopsa;      // Loco address (ops mode) bit 7-13
+    uint8_t         lopsa;      // Loco address (ops mode) bit 0-6
+    uint8_t         trk;
+    uint8_t         cvh;        // CV bit 7 (bit 0), bit 8-9 (bit 4-5), data bit 7 (bit 1)
+    uint8_t         cvl;        // CV bit 0-6
+    uint8_t         data7;      // Data bit 0-6
+    uint8_t         zero1;
+    uint8_t         zero2;
+} lnpacket_prog_t;
+
 /*
  * Unified LocoNet packet.
  * Contains all of the above.
@@ -221,6 +266,7 @@ typedef union
     lnpacket_move_slots_t move_slots;
     lnpacket_rq_sl_data_t rq_sl_data;
     lnpacket_loco_adr_t loco_adr;
+    lnpacket_prog_t prog;
 } lnpacket_t;
 
 
@@ -0,0 +1,306 @@
+/*
+ * ln_input.c
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "hal_ln.h"
+#include "ln_input.h"
+#include "ln_tx.h"
+
+/**
+ * Number of inputs.
+ */
+#ifndef LN_INPUT_CNT
+#define LN_INPUT_CNT        16
+#endif
+
+/**
+ * Default debounce time for free to occupied transition (ms).
+ */
+#ifndef LN_INPUT_OCC_MS
+#define LN_INPUT_OCC_MS     10
+#endif
+
+/**
+ * Default debounce time for occupied to free transition (ms).
+ */
+#ifndef LN_INPUT_FREE_MS
+#define LN_INPUT_FREE_MS    500
+#endif
+
+/**
+ * Minimum time between refresh reports (ms).
+ * Also used for spreading out the reports at power-up.
+ */
+#ifndef LN_INPUT_REFRESH_MS
+#define LN_INPUT_REFRESH_MS 20
+#endif
+
+/**
+ * Max number of input reports in tx queue at the same time.
+ */
+#ifndef LN_INPUT_INFLIGHT
+#define LN_INPUT_INFLIGHT   1
+#endif
+
+/**
+ * Number of time slots for interrogation replies.
+ * The slot of a node is given by its input address.
+ */
+#ifndef LN_INPUT_IQ_SLOTS
+#define LN_INPUT_IQ_SLOTS   32
+#endif
+
+/**
+ * Length of one interrogation reply slot (ms).
+ */
+#ifndef LN_INPUT_IQ_SLOT_MS
+#define LN_INPUT_IQ_SLOT_MS 100
+#endif
+
+/**
+ * Max number of interrogation replies in tx queue at the same time.
+ */
+#ifndef LN_INPUT_IQ_BATCH
+#define LN_INPUT_IQ_BATCH   4
+#endif
+
+/*
+ * Debounce times are stored in units of 8 ticks (approx. 8 ms), in 8 bits.
+ * Longer times are limited to 255 units (approx. 1990 ms).
+ */
+#define DEB_SHIFT       3
+#define DEB_MAX_MS      1990
+
+#if LN_INPUT_OCC_MS > DEB_MAX_MS || LN_INPUT_FREE_MS > DEB_MAX_MS
+#error "LN_INPUT_OCC_MS and LN_INPUT_FREE_MS must be at most 1990"
+#endif
+
+#define IN_RAW          0x01    // Raw input state at last scan
+#define IN_STABLE       0x02    // Debounced state
+#define IN_REPORTED     0x04    // State last reported on LocoNet
+#define IN_REFRESH      0x08    // Report state again
+#define IN_BUSY         0x10    // Report in tx queue
+#define IN_IQ           0x20    // Report as interrogation reply
+
+#define NONE            0xff
+
+#if LN_INPUT_CNT >= NONE
+#error "LN_INPUT_CNT too large"
+#endif
+
+// Length of the whole interrogation reply window (all slots)
+#define IQ_WINDOW_MS    ((uint32_t)LN_INPUT_IQ_SLOTS * LN_INPUT_IQ_SLOT_MS)
+
+#if LN_INPUT_IQ_SLOTS * LN_INPUT_IQ_SLOT_MS > 30000
+#error "LN_INPUT_IQ_SLOTS * LN_INPUT_IQ_SLOT_MS too large"
+#endif
+
+typedef struct
+{
+    uint16_t        time;       // Time of last raw change
+    uint8_t         deb_occ;
+    uint8_t         deb_free;
+    uint8_t         flags;
+} input_t;
+
+static input_t  inputs[LN_INPUT_CNT];
+static uint16_t input_adr;
+static uint16_t refresh_time;
+static uint8_t  inflight;
+static uint16_t iq_start;       // Start of interrogation reply window
+static uint16_t iq_time;        // Start of our slot
+static bool     iq_active;
+
+
+static uint8_t deb_ticks(uint16_t ms)
+{
+    uint16_t        deb = (HAL_LN_MS(ms) + (1 << DEB_SHIFT) - 1) >> DEB_SHIFT;
+
+    return deb > 0xff ? 0xff : deb;
+}
+
+void ln_input_init(uint16_t adr)
+{
+    uint16_t        now = hal_ln_time();
+
+    input_adr = adr;
+    refresh_time = now;
+    for (uint8_t i = 0; i < LN_INPUT_CNT; i++)
+    {
+        input_t        *in = &inputs[i];
+
+        in->time = now;
+        in->deb_occ = deb_ticks(LN_INPUT_OCC_MS);
+        in->deb_free = deb_ticks(LN_INPUT_FREE_MS);
+        // Reported state equals stable state, so power-up reports are sent
+        // as rate limited refresh reports, not as transitions
+        in->flags = ln_input_read(i) ? (IN_RAW | IN_STABLE | IN_REPORTED | IN_REFRESH) : IN_REFRESH;
+    }
+}
+
+void ln_input_debounce(uint8_t idx, uint16_t occ_ms, uint16_t free_ms)
+{
+    if (idx >= LN_INPUT_CNT)
+        return;
+    inputs[idx].deb_occ = deb_ticks(occ_ms);
+    inputs[idx].deb_free = deb_ticks(free_ms);
+}
+
+void ln_input_refresh(void)
+{
+    for (uint8_t i = 0; i < LN_INPUT_CNT; i++)
+        inputs[i].flags |= IN_REFRESH;
+}
+
+void ln_input_interrogate(void)
+{
+    uint8_t         slot = ((input_adr - 1) / LN_INPUT_CNT) % LN_INPUT_IQ_SLOTS;
+    uint16_t        now = hal_ln_time();
+
+    if (iq_active && (uint16_t)(now - iq_start) < HAL_LN_MS(IQ_WINDOW_MS))
+        return;                 // Rest of interrogation sequence
+
+    iq_active = true;
+    iq_start = now;
+    iq_time = now + HAL_LN_MS((uint16_t)slot * LN_INPUT_IQ_SLOT_MS);
+    for (uint8_t i = 0; i < LN_INPUT_CNT; i++)
+        inputs[i].flags |= IN_IQ;
+}
+
+bool ln_input_state(uint8_t idx)
+{
+    if (idx >= LN_INPUT_CNT)
+        return false;
+    return (inputs[idx].flags & IN_STABLE) != 0;
+}
+
+/*
+ * Tx done callback. ctx points to input.
+ */
+static void input_tx_done(void *ctx, hal_ln_result_t res)
+{
+    input_t        *in = ctx;
+
+    inflight--;
+    in->flags &= ~IN_BUSY;
+    if (res != HAL_LN_SUCCESS)
+        in->flags |= IN_REFRESH;        // Try again later
+}
+
+/*
+ * Send report for input.
+ */
+static bool input_send(uint8_t idx)
+{
+    input_t        *in = &inputs[idx];
+    bool            occ = (in->flags & IN_STABLE) != 0;
+
+    if (ln_tx_opc_input_rep(input_adr + idx, occ, input_tx_done, in))
+        return false;           // Out of packets
+
+    inflight++;
+    in->flags &= ~(IN_REPORTED | IN_REFRESH | IN_IQ);
+    in->flags |= IN_BUSY | (occ ? IN_REPORTED : 0);
+    return true;
+}
+
+void ln_input_update(void)
+{
+    uint16_t        now = hal_ln_time();
+    uint8_t         occ = NONE, chg = NONE, refresh = NONE, iq = NONE;
+    uint8_t         max = LN_INPUT_INFLIGHT;
+
+    hal_ln_wake_tick();         // Inputs are polled (no pin change interrupt)
+
+    for (uint8_t i = 0; i < LN_INPUT_CNT; i++)
+    {
+        input_t        *in = &inputs[i];
+        uint8_t         flags = in->flags;
+
+        // Debounce
+        if (ln_input_read(i))
+        {
+            if (!(flags & IN_RAW))
+            {
+                flags |= IN_RAW;
+                in->time = now;
+            }
+            else if (!(flags & IN_STABLE) && (uint16_t)(now - in->time) >= ((uint16_t)in->deb_occ << DEB_SHIFT))
+            {
+                flags |= IN_STABLE;
+            }
+        }
+        else
+        {
+            if (flags & IN_RAW)
+            {
+                flags &= ~IN_RAW;
+                in->time = now;
+            }
+            else if ((flags & IN_STABLE) && (uint16_t)(now - in->time) >= ((uint16_t)in->deb_free << DEB_SHIFT))
+            {
+                flags &= ~IN_STABLE;
+            }
+        }
+        in->flags = flags;
+
+        // Find next report to send
+        if (flags & IN_BUSY)
+            continue;
+        if (((flags & IN_STABLE) != 0) != ((flags & IN_REPORTED) != 0))
+        {
+            if (flags & IN_STABLE)
+            {
+                if (occ == NONE)
+                    occ = i;
+            }
+            else if (chg == NONE)
+            {
+                chg = i;
+            }
+        }
+        else if ((flags & IN_IQ) && iq == NONE)
+        {
+            iq = i;
+        }
+        else if ((flags & IN_REFRESH) && refresh == NONE)
+        {
+            refresh = i;
+        }
+    }
+
+    if (iq_active && (uint16_t)(now - iq_start) >= HAL_LN_MS(IQ_WINDOW_MS))
+        iq_active = false;      // Reply window passed
+
+    if (iq != NONE)
+    {
+        if ((int16_t)(now - iq_time) >= 0)
+            max = LN_INPUT_IQ_BATCH;    // Our slot: Send replies back to back
+        else
+            iq = NONE;          // Wait for our slot
+    }
+
+    if (inflight >= max)
+        return;
+
+    // Transitions to occupied first, then to free, interrogation replies and refresh last
+    if (occ != NONE)
+    {
+        input_send(occ);
+    }
+    else if (chg != NONE)
+    {
+        input_send(chg);
+    }
+    else if (iq != NONE)
+    {
+        input_send(iq);
+    }
+    else if (refresh != NONE && (int16_t)(now - refresh_time) >= 0)
+    {
+        if (input_send(refresh))
+            refresh_time = now + HAL_LN_MS(LN_INPUT_REFRESH_MS);
+    }
+}
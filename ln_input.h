@@ -0,0 +1,85 @@
+/*
+ * ln_input.h
+ */
+
+#ifndef LN_INPUT_H_
+#define LN_INPUT_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+/**
+ * Init input handling.
+ *
+ * All inputs are read, and their state is reported on LocoNet,
+ * spread out over time (LN_INPUT_REFRESH_MS between each report).
+ *
+ * @param adr LocoNet address of first input. Input n reports as adr + n.
+ */
+extern void     ln_input_init(uint16_t adr);
+
+/**
+ * Set debounce time for an input.
+ *
+ * Times are limited to approx. 1990 ms.
+ *
+ * @param idx      Input index.
+ * @param occ_ms   Time input must be stable active before reporting occupied.
+ * @param free_ms  Time input must be stable inactive before reporting free.
+ */
+extern void     ln_input_debounce(uint8_t idx, uint16_t occ_ms, uint16_t free_ms);
+
+/**
+ * Report state of all inputs again.
+ *
+ * Reports are rate limited and sent after any pending state changes.
+ */
+extern void     ln_input_refresh(void);
+
+/**
+ * Reply to command station interrogation.
+ *
+ * State of all inputs is reported in a time slot given by the input address
+ * (LN_INPUT_IQ_SLOTS slots of LN_INPUT_IQ_SLOT_MS), with up to
+ * LN_INPUT_IQ_BATCH reports queued at a time, so nodes don't all answer at
+ * once. Calls until the whole reply window (all slots) has passed are
+ * ignored (rest of the interrogation sequence).
+ * Called from ln_rx_update if LNINTERROGATE is defined.
+ */
+extern void     ln_input_interrogate(void);
+
+/**
+ * Get debounced state of input.
+ *
+ * @param idx Input index.
+ * @return    true if occupied.
+ */
+extern bool     ln_input_state(uint8_t idx);
+
+/**
+ * Update input handling.
+ *
+ * Call regularly from mainloop.
+ */
+extern void     ln_input_update(void);
+
+/**
+ * Read raw input state.
+ *
+ * Must be provided by the application.
+ *
+ * @param idx Input index (0 to LN_INPUT_CNT - 1).
+ * @return    true if input is active (occupied).
+ */
+extern bool     ln_input_read(uint8_t idx);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* LN_INPUT_H_ */
@@ -0,0 +1,231 @@
+/*
+ * ln_pc.c
+ */
+
+#include <avr/interrupt.h>
+#include <avr/io.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <util/atomic.h>
+#include "hal_ln.h"
+#include "ln_def.h"
+#include "ln_pc.h"
+
+/*
+ * LocoBuffer compatible PC interface.
+ *
+ * Raw LocoNet packets in both directions on a second USART.
+ * Packets from the PC are sent on LocoNet, and everything received on
+ * LocoNet (including the echo of the packets from the PC) is sent to the PC.
+ * Packets are passed on as LocoNet packets from the pool, without copying.
+ * CTS (active low) tells the PC when it may send.
+ */
+
+#ifndef LNECHO
+#error "ln_pc requires LNECHO, the PC expects the echo of its own packets"
+#endif
+
+/**
+ * USART and pins used for PC interface.
+ */
+#ifndef LN_PC_USART
+#define LN_PC_USART     USART1
+#define LN_PC_RXC_vect  USART1_RXC_vect
+#define LN_PC_DRE_vect  USART1_DRE_vect
+#define LN_PC_PORT      PORTC
+#define LN_PC_TX_bm     PIN0_bm
+#define LN_PC_RX_bm     PIN1_bm
+#endif
+
+#ifndef LN_PC_CTS_PORT
+#define LN_PC_CTS_PORT  PORTC
+#define LN_PC_CTS_bm    PIN3_bm
+#endif
+
+/**
+ * PC interface baudrate.
+ */
+#ifndef LN_PC_BAUDRATE
+#define LN_PC_BAUDRATE  57600UL
+#endif
+
+#define LN_PC_BAUD_REG  ((64 * F_CPU + 8 * LN_PC_BAUDRATE) / (16 * LN_PC_BAUDRATE))
+
+/**
+ * Number of packets buffered in each direction. Must be a power of 2.
+ */
+#ifndef LN_PC_BUF
+#define LN_PC_BUF       4
+#endif
+
+#if LN_PC_BUF & (LN_PC_BUF - 1)
+#error "LN_PC_BUF must be a power of 2"
+#endif
+
+#define BUF_MASK        (LN_PC_BUF - 1)
+
+
+/*
+ * PC to LocoNet.
+ */
+static lnpacket_t *rx_buf[LN_PC_BUF];
+static volatile uint8_t rx_head;        // Written by interrupt
+static uint8_t  rx_tail;
+static lnpacket_t *rx_cur = NULL;       // Packet being received
+static lnpacket_t *volatile rx_next = NULL;     // Packet ready for next reception
+static uint8_t  rx_idx;
+static uint8_t  rx_len;
+static uint8_t  rx_cksum;
+
+/*
+ * LocoNet to PC.
+ */
+static lnpacket_t *tx_buf[LN_PC_BUF];
+static uint8_t  tx_head;
+static volatile uint8_t tx_done;        // Written by interrupt
+static uint8_t  tx_free;
+static uint8_t  tx_idx;
+static uint8_t  tx_len;
+
+
+/*
+ * Set CTS according to buffer state.
+ */
+static void cts_update(void)
+{
+    if (rx_next && (uint8_t)(rx_head - rx_tail) < LN_PC_BUF)
+        LN_PC_CTS_PORT.OUTCLR = LN_PC_CTS_bm;   // Clear to send
+    else
+        LN_PC_CTS_PORT.OUTSET = LN_PC_CTS_bm;
+}
+
+/*
+ * RX complete interrupt.
+ * Receive packet from PC.
+ */
+ISR(LN_PC_RXC_vect)
+{
+    uint8_t         status;
+    uint8_t         data;
+
+    status = LN_PC_USART.RXDATAH;       // Must be read before RXDATAL
+    data = LN_PC_USART.RXDATAL;
+
+    if (status & USART_FERR_bm)
+    {
+        rx_idx = 0;             // Framing error: Drop byte and restart packet
+        return;
+    }
+
+    if (data & 0x80)
+        rx_idx = 0;             // Always restart on opcode
+
+    if (rx_idx == 0)
+    {
+        if (!(data & 0x80))
+            return;             // Wait for opcode
+        if (!rx_cur)
+        {
+            rx_cur = rx_next;
+            rx_next = NULL;
+            cts_update();
+            if (!rx_cur)
+                return;         // PC didn't respect CTS
+        }
+        rx_cksum = 0;
+    }
+
+    if (rx_idx < LNPACKET_SIZE_MAX)
+        rx_cur->raw[rx_idx] = data;
+    rx_idx++;
+    rx_cksum ^= data;
+    if (rx_idx == 2)
+        rx_len = hal_ln_packet_len(rx_cur);
+    if (rx_idx >= 2 && rx_idx >= rx_len)
+    {
+        if (rx_cksum == 0xff && rx_idx <= LNPACKET_SIZE_MAX && (uint8_t)(rx_head - rx_tail) < LN_PC_BUF)
+        {
+            rx_buf[rx_head & BUF_MASK] = rx_cur;
+            rx_head++;
+            rx_cur = NULL;
+            cts_update();
+        }
+        rx_idx = 0;
+    }
+}
+
+/*
+ * Data register empty interrupt.
+ * Send next byte to PC.
+ */
+ISR(LN_PC_DRE_vect)
+{
+    lnpacket_t     *p = tx_buf[tx_done & BUF_MASK];
+
+    if (tx_idx == 0)
+        tx_len = hal_ln_packet_len(p);
+    LN_PC_USART.TXDATAL = p->raw[tx_idx++];
+    if (tx_idx >= tx_len)
+    {
+        tx_idx = 0;
+        tx_done++;
+        if (tx_done == tx_head)
+            LN_PC_USART.CTRLA &= ~USART_DREIE_bm;
+    }
+}
+
+void ln_pc_init(void)
+{
+    LN_PC_PORT.DIRCLR = LN_PC_RX_bm;
+    LN_PC_PORT.OUTSET = LN_PC_TX_bm;
+    LN_PC_PORT.DIRSET = LN_PC_TX_bm;
+    LN_PC_CTS_PORT.OUTSET = LN_PC_CTS_bm;       // Not clear to send
+    LN_PC_CTS_PORT.DIRSET = LN_PC_CTS_bm;
+
+    LN_PC_USART.CTRLA = USART_RXCIE_bm | USART_RS485_DISABLE_gc;
+    LN_PC_USART.CTRLC = USART_CMODE_ASYNCHRONOUS_gc | USART_PMODE_DISABLED_gc | USART_SBMODE_1BIT_gc | USART_CHSIZE_8BIT_gc;
+    LN_PC_USART.BAUD = LN_PC_BAUD_REG;
+    LN_PC_USART.CTRLB = USART_RXEN_bm | USART_TXEN_bm | USART_RXMODE_NORMAL_gc;
+
+    rx_next = hal_ln_packet_get();
+    cts_update();
+}
+
+void ln_pc_update(void)
+{
+    lnpacket_t     *p;
+
+    // Send packets from PC on LocoNet
+    while (rx_tail != rx_head)
+    {
+        hal_ln_send(rx_buf[rx_tail & BUF_MASK], NULL, NULL);
+        rx_tail++;
+    }
+
+    // Free packets sent to PC
+    while (tx_free != tx_done)
+    {
+        hal_ln_packet_free(tx_buf[tx_free & BUF_MASK]);
+        tx_free++;
+    }
+
+    // Queue received LocoNet packets for PC
+    while ((uint8_t)(tx_head - tx_free) < LN_PC_BUF && (p = hal_ln_receive()) != NULL)
+    {
+        tx_buf[tx_head & BUF_MASK] = p;
+        ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+        {
+            tx_head++;
+            LN_PC_USART.CTRLA |= USART_DREIE_bm;
+        }
+    }
+
+    // Get packet ready for next reception from PC
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+    {
+        if (!rx_next)
+            rx_next = hal_ln_packet_get();
+        cts_update();
+    }
+}
@@ -0,0 +1,33 @@
+/*
+ * ln_pc.h
+ */
+
+#ifndef LN_PC_H_
+#define LN_PC_H_
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+/**
+ * Init PC interface.
+ *
+ * Call once from main program after hal_ln_init, before interrupts are enabled.
+ */
+extern void     ln_pc_init(void);
+
+/**
+ * Update PC interface.
+ *
+ * Call regularly from mainloop.
+ * Takes all received LocoNet packets (don't use ln_rx_update or
+ * hal_ln_receive at the same time).
+ */
+extern void     ln_pc_update(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* LN_PC_H_ */
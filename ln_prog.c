@@ -0,0 +1,316 @@
+/*
+ * ln_prog.c
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "hal_ln.h"
+#include "ln_def.h"
+#include "ln_prog.h"
+
+/*
+ * CV programming through the command station programmer (slot 0x7c).
+ *
+ * Request: OPC_WR_SL_DATA to slot 0x7c.
+ * Answer:  OPC_LONG_ACK (busy, accepted or accepted blind), and for accepted
+ *          tasks an OPC_SL_RD_DATA from slot 0x7c with the result.
+ */
+
+/**
+ * Number of CV operations that can be queued.
+ */
+#ifndef LN_PROG_QUEUE
+#define LN_PROG_QUEUE       8
+#endif
+
+/**
+ * Time to wait for OPC_LONG_ACK (ms).
+ */
+#ifndef LN_PROG_ACK_MS
+#define LN_PROG_ACK_MS      500
+#endif
+
+/**
+ * Time to wait for the result of an accepted task (ms).
+ */
+#ifndef LN_PROG_RESULT_MS
+#define LN_PROG_RESULT_MS   5000
+#endif
+
+/**
+ * Time before a request is sent again when programmer is busy (ms).
+ */
+#ifndef LN_PROG_BUSY_MS
+#define LN_PROG_BUSY_MS     100
+#endif
+
+/**
+ * Number of busy answers before an operation is given up.
+ */
+#ifndef LN_PROG_BUSY_CNT
+#define LN_PROG_BUSY_CNT    20
+#endif
+
+#if LN_PROG_QUEUE > 255
+#error "LN_PROG_QUEUE too large"
+#endif
+
+#if LNPACKET_SIZE_MAX < LN_PROG_LEN
+#error "ln_prog requires LNPACKET_SIZE_MAX of at least 14"
+#endif
+
+#define PCMD_DIRECT_RD  (LN_PCMD_BYTE | LN_PCMD_FEEDBACK)
+#define PCMD_DIRECT_WR  (LN_PCMD_BYTE | LN_PCMD_FEEDBACK | LN_PCMD_WRITE)
+#define PCMD_OPS_RD     (LN_PCMD_BYTE | LN_PCMD_FEEDBACK | LN_PCMD_OPS)
+#define PCMD_OPS_WR     (LN_PCMD_BYTE | LN_PCMD_OPS | LN_PCMD_WRITE)
+
+typedef enum
+{
+    ST_IDLE,
+    ST_SEND,                    // Waiting to send request
+    ST_TX,                      // Request in tx queue
+    ST_ACK,                     // Waiting for OPC_LONG_ACK
+    ST_RESULT                   // Waiting for OPC_SL_RD_DATA
+} prog_state_t;
+
+typedef struct
+{
+    uint16_t        cv;
+    uint16_t        adr;
+    uint8_t         val;
+    uint8_t         pcmd;
+    ln_prog_cb_t   *cb;
+    void           *ctx;
+} prog_op_t;
+
+static prog_op_t queue[LN_PROG_QUEUE];
+static uint8_t  queue_head;
+static uint8_t  queue_cnt;
+static prog_state_t state = ST_IDLE;
+static uint16_t state_time;
+static uint8_t  busy_cnt;
+static uint8_t  seq;            // Sequence number of request in tx (tx done ctx)
+
+
+static void     prog_tx_done(void *ctx, hal_ln_result_t res);
+
+
+/*
+ * Send request for operation at head of queue.
+ */
+static void prog_send(void)
+{
+    const prog_op_t *op = &queue[queue_head];
+    lnpacket_t     *p = hal_ln_packet_get();
+    uint16_t        cv = op->cv - 1;
+
+    if (!p)
+        return;                 // Out of packets, try again from ln_prog_update
+
+    p->prog.op = OPC_WR_SL_DATA;
+    p->prog.len = LN_PROG_LEN;
+    p->prog.slot = LN_SLOT_PROG;
+    p->prog.pcmd = op->pcmd;
+    p->prog.pstat = 0;
+    p->prog.hopsa = (op->adr >> 7) & 0x7f;
+    p->prog.lopsa = op->adr & 0x7f;
+    p->prog.trk = 0;
+    p->prog.cvh = ((cv >> 7) & 0x01) | ((cv >> 4) & 0x30) | ((op->val >> 6) & 0x02);
+    p->prog.cvl = cv & 0x7f;
+    p->prog.data7 = op->val & 0x7f;
+    p->prog.zero1 = 0;
+    p->prog.zero2 = 0;
+
+    // Answer timeout starts when request has been sent (prog_tx_done)
+    state = ST_TX;
+    hal_ln_send(p, prog_tx_done, (void *)(uintptr_t)++seq);
+}
+
+/*
+ * Start operation at head of queue.
+ */
+static void prog_start(void)
+{
+    state = ST_SEND;
+    state_time = hal_ln_time();
+    prog_send();
+}
+
+/*
+ * Finish operation at head of queue.
+ * Request for the next operation is sent before the callback, so the
+ * programmer is kept busy.
+ */
+static void prog_done(ln_prog_result_t res, uint8_t val)
+{
+    prog_op_t       op = queue[queue_head];
+
+    queue_head = (queue_head + 1) % LN_PROG_QUEUE;
+    queue_cnt--;
+    busy_cnt = 0;
+    state = ST_IDLE;
+    if (queue_cnt)
+        prog_start();
+
+    if (op.cb)
+        op.cb(op.ctx, op.cv, res, val);
+}
+
+/*
+ * Tx done callback. ctx is sequence number of request.
+ * Callbacks for older requests (busy retries, finished operations) are ignored.
+ */
+static void prog_tx_done(void *ctx, hal_ln_result_t res)
+{
+    if ((uint8_t)(uintptr_t)ctx != seq || state != ST_TX)
+        return;
+
+    if (res != HAL_LN_SUCCESS)
+    {
+        prog_done(LN_PROG_TX_FAIL, queue[queue_head].val);
+        return;
+    }
+
+    state = ST_ACK;
+    state_time = hal_ln_time();
+}
+
+/*
+ * Add operation to queue.
+ */
+static int8_t prog_queue(uint16_t adr, uint16_t cv, uint8_t val, uint8_t pcmd, ln_prog_cb_t * cb, void *ctx)
+{
+    prog_op_t      *op;
+
+    if (queue_cnt >= LN_PROG_QUEUE)
+        return -1;
+
+    op = &queue[(queue_head + queue_cnt) % LN_PROG_QUEUE];
+    op->cv = cv;
+    op->adr = adr;
+    op->val = val;
+    op->pcmd = pcmd;
+    op->cb = cb;
+    op->ctx = ctx;
+    queue_cnt++;
+
+    if (state == ST_IDLE)
+        prog_start();
+
+    return 0;
+}
+
+int8_t ln_prog_read(uint16_t cv, ln_prog_cb_t * cb, void *ctx)
+{
+    return prog_queue(0, cv, 0, PCMD_DIRECT_RD, cb, ctx);
+}
+
+int8_t ln_prog_write(uint16_t cv, uint8_t val, ln_prog_cb_t * cb, void *ctx)
+{
+    return prog_queue(0, cv, val, PCMD_DIRECT_WR, cb, ctx);
+}
+
+int8_t ln_prog_ops_read(uint16_t adr, uint16_t cv, ln_prog_cb_t * cb, void *ctx)
+{
+    return prog_queue(adr, cv, 0, PCMD_OPS_RD, cb, ctx);
+}
+
+int8_t ln_prog_ops_write(uint16_t adr, uint16_t cv, uint8_t val, ln_prog_cb_t * cb, void *ctx)
+{
+    return prog_queue(adr, cv, val, PCMD_OPS_WR, cb, ctx);
+}
+
+uint8_t ln_prog_pending(void)
+{
+    return queue_cnt;
+}
+
+bool ln_prog_rx(const lnpacket_t *p)
+{
+    if (p->hdr.op == OPC_LONG_ACK)
+    {
+        // Answer may be read before the tx done callback has been called
+        if (p->long_ack.lopc != (OPC_WR_SL_DATA & 0x7f) || (state != ST_TX && state != ST_ACK))
+            return false;
+
+        switch (p->long_ack.ack1)
+        {
+        case LN_PROG_ACK_BUSY:
+            if (++busy_cnt >= LN_PROG_BUSY_CNT)
+            {
+                prog_done(LN_PROG_REJECTED, queue[queue_head].val);
+                break;
+            }
+            state = ST_SEND;
+            state_time = hal_ln_time() + HAL_LN_MS(LN_PROG_BUSY_MS);
+            break;
+
+        case LN_PROG_ACK_OK:
+            state = ST_RESULT;
+            state_time = hal_ln_time();
+            break;
+
+        case LN_PROG_ACK_BLIND:
+            prog_done(LN_PROG_OK, queue[queue_head].val);
+            break;
+
+        default:
+            prog_done(LN_PROG_REJECTED, queue[queue_head].val);
+            break;
+        }
+        return true;
+    }
+
+    if (p->hdr.op == OPC_SL_RD_DATA && p->hdr.len == LN_PROG_LEN && p->prog.slot == LN_SLOT_PROG)
+    {
+        // Some command stations send the result without OPC_LONG_ACK first
+        if (state == ST_RESULT || state == ST_ACK || state == ST_TX)
+        {
+            uint8_t         pstat = p->prog.pstat;
+            uint8_t         val = p->prog.data7 | ((p->prog.cvh & 0x02) << 6);
+            ln_prog_result_t res = LN_PROG_OK;
+
+            if (pstat & LN_PSTAT_NO_DECODER)
+                res = LN_PROG_NO_DECODER;
+            else if (pstat & LN_PSTAT_ABORTED)
+                res = LN_PROG_ABORTED;
+            else if (pstat & (LN_PSTAT_NO_WR_ACK | LN_PSTAT_NO_RD_ACK))
+                res = LN_PROG_NO_ACK;
+
+            prog_done(res, val);
+        }
+        return true;
+    }
+
+    return false;
+}
+
+void ln_prog_update(void)
+{
+    uint16_t        now = hal_ln_time();
+
+    if (state != ST_IDLE)
+        hal_ln_wake_tick();     // Retry and answer timeouts
+
+    switch (state)
+    {
+    case ST_SEND:
+        if ((int16_t)(now - state_time) >= 0)
+            prog_send();
+        break;
+
+    case ST_ACK:
+        if ((uint16_t)(now - state_time) >= HAL_LN_MS(LN_PROG_ACK_MS))
+            prog_done(LN_PROG_TIMEOUT, queue[queue_head].val);
+        break;
+
+    case ST_RESULT:
+        if ((uint16_t)(now - state_time) >= HAL_LN_MS(LN_PROG_RESULT_MS))
+            prog_done(LN_PROG_TIMEOUT, queue[queue_head].val);
+        break;
+
+    default:
+        break;
+    }
+}
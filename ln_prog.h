@@ -0,0 +1,119 @@
+/*
+ * ln_prog.h
+ */
+
+#ifndef LN_PROG_H_
+#define LN_PROG_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "hal_ln.h"
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+/**
+ * Result of CV operation.
+ */
+typedef enum
+{
+    LN_PROG_OK,                 // Done (value is valid for reads)
+    LN_PROG_NO_DECODER,         // No decoder on programming track
+    LN_PROG_NO_ACK,             // Decoder didn't acknowledge read or write
+    LN_PROG_ABORTED,            // Aborted by user at command station
+    LN_PROG_REJECTED,           // Command station has no programmer, or stayed busy
+    LN_PROG_TIMEOUT,            // No answer from command station
+    LN_PROG_TX_FAIL             // Request could not be sent on LocoNet
+} ln_prog_result_t;
+
+/**
+ * Callback type for finished CV operation.
+ *
+ * @param ctx Pointer given when operation was queued.
+ * @param cv  CV number (1-1024).
+ * @param res Result of operation.
+ * @param val CV value read (or written).
+ */
+typedef void    (ln_prog_cb_t) (void *ctx, uint16_t cv, ln_prog_result_t res, uint8_t val);
+
+/**
+ * Queue CV read on programming track (direct mode).
+ *
+ * Operations are done in order through the command station programmer
+ * (slot 0x7c). The next request is sent as soon as the result of the
+ * previous one is received. The callback may queue new operations.
+ *
+ * @param cv  CV number (1-1024).
+ * @param cb  Callback function for result. Set to NULL if not used.
+ * @param ctx Pointer to context data, that will be passed on to
+ *            the callback function.
+ * @return    0 if queued, -1 if queue is full.
+ */
+extern int8_t   ln_prog_read(uint16_t cv, ln_prog_cb_t * cb, void *ctx);
+
+/**
+ * Queue CV write on programming track (direct mode).
+ *
+ * @param cv  CV number (1-1024).
+ * @param val Value to write.
+ * @param cb  Callback function for result. Set to NULL if not used.
+ * @param ctx Pointer to context data, that will be passed on to
+ *            the callback function.
+ * @return    0 if queued, -1 if queue is full.
+ */
+extern int8_t   ln_prog_write(uint16_t cv, uint8_t val, ln_prog_cb_t * cb, void *ctx);
+
+/**
+ * Queue CV read on main track (ops mode with feedback).
+ *
+ * @param adr Loco address.
+ * @param cv  CV number (1-1024).
+ * @param cb  Callback function for result. Set to NULL if not used.
+ * @param ctx Pointer to context data, that will be passed on to
+ *            the callback function.
+ * @return    0 if queued, -1 if queue is full.
+ */
+extern int8_t   ln_prog_ops_read(uint16_t adr, uint16_t cv, ln_prog_cb_t * cb, void *ctx);
+
+/**
+ * Queue CV write on main track (ops mode).
+ *
+ * @param adr Loco address.
+ * @param cv  CV number (1-1024).
+ * @param val Value to write.
+ * @param cb  Callback function for result. Set to NULL if not used.
+ * @param ctx Pointer to context data, that will be passed on to
+ *            the callback function.
+ * @return    0 if queued, -1 if queue is full.
+ */
+extern int8_t   ln_prog_ops_write(uint16_t adr, uint16_t cv, uint8_t val, ln_prog_cb_t * cb, void *ctx);
+
+/**
+ * Number of queued operations, including the one in progress.
+ */
+extern uint8_t  ln_prog_pending(void);
+
+/**
+ * Handle received OPC_LONG_ACK and OPC_SL_RD_DATA.
+ *
+ * Called from ln_rx_update if LNPROG is defined.
+ *
+ * @param p Received LocoNet packet.
+ * @return  true if packet was an answer from the programmer.
+ */
+extern bool     ln_prog_rx(const lnpacket_t *p);
+
+/**
+ * Update CV programming (timeouts and retries).
+ *
+ * Call regularly from mainloop.
+ */
+extern void     ln_prog_update(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* LN_PROG_H_ */
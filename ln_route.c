@@ -0,0 +1,248 @@
+/*
+ * ln_route.c
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include "hal_ln.h"
+#include "ln_route.h"
+#include "ln_tx.h"
+
+/**
+ * Max number of route packets in tx queue at the same time.
+ * Keeps the route from flooding the tx queue and the packet pool.
+ */
+#ifndef LN_ROUTE_INFLIGHT
+#define LN_ROUTE_INFLIGHT   2
+#endif
+
+/**
+ * Time from SW_REQ ON to SW_REQ OFF for a turnout (ms).
+ */
+#ifndef LN_ROUTE_ON_MS
+#define LN_ROUTE_ON_MS      100
+#endif
+
+/**
+ * Minimum time between two SW_REQ ON (ms). 0 = as fast as the bus allows.
+ */
+#ifndef LN_ROUTE_GAP_MS
+#define LN_ROUTE_GAP_MS     0
+#endif
+
+/**
+ * Number of SW_REQ OFF waiting for their time.
+ * When full, no more turnouts are switched ON until an OFF has been sent.
+ */
+#ifndef LN_ROUTE_OFF_CNT
+#define LN_ROUTE_OFF_CNT    8
+#endif
+
+/**
+ * Highest turnout address with known state. 0 disables skipping of
+ * redundant requests.
+ */
+#ifndef LN_ROUTE_ADR_MAX
+#define LN_ROUTE_ADR_MAX    256
+#endif
+
+
+typedef struct
+{
+    uint16_t        adr;
+    uint16_t        time;
+    bool            dir;
+    bool            cancel;     // ON failed, don't send OFF
+    const ln_route_entry_t *on; // Route entry of paired ON
+} route_off_t;
+
+static const ln_route_entry_t *route = NULL;
+static uint8_t  route_cnt;
+static uint8_t  route_idx;
+static hal_ln_tx_done_cb_t *route_cb;
+static void    *route_ctx;
+static hal_ln_result_t route_res;
+static uint16_t route_next_on;
+static uint8_t  inflight;
+
+static route_off_t off[LN_ROUTE_OFF_CNT];
+static uint8_t  off_head;
+static uint8_t  off_cnt;
+
+#if LN_ROUTE_ADR_MAX > 0
+static uint8_t  sw_known[(LN_ROUTE_ADR_MAX + 7) / 8];
+static uint8_t  sw_dir[(LN_ROUTE_ADR_MAX + 7) / 8];
+#endif
+
+
+/*
+ * Known turnout state handling.
+ */
+static bool sw_is(uint16_t adr, bool dir)
+{
+#if LN_ROUTE_ADR_MAX > 0
+    uint8_t         mask;
+
+    if (adr == 0 || adr > LN_ROUTE_ADR_MAX)
+        return false;
+    adr--;
+    mask = 1 << (adr & 0x07);
+    adr >>= 3;
+    if (!(sw_known[adr] & mask))
+        return false;
+    return ((sw_dir[adr] & mask) != 0) == dir;
+#else
+    return false;
+#endif
+}
+
+static void sw_set(uint16_t adr, bool dir, bool known)
+{
+#if LN_ROUTE_ADR_MAX > 0
+    uint8_t         mask;
+
+    if (adr == 0 || adr > LN_ROUTE_ADR_MAX)
+        return;
+    adr--;
+    mask = 1 << (adr & 0x07);
+    adr >>= 3;
+    if (known)
+        sw_known[adr] |= mask;
+    else
+        sw_known[adr] &= ~mask;
+    if (dir)
+        sw_dir[adr] |= mask;
+    else
+        sw_dir[adr] &= ~mask;
+#endif
+}
+
+void ln_route_sw_state(uint16_t adr, bool dir)
+{
+    sw_set(adr, dir, true);
+}
+
+void ln_route_forget(void)
+{
+#if LN_ROUTE_ADR_MAX > 0
+    memset(sw_known, 0, sizeof(sw_known));
+#endif
+}
+
+
+/*
+ * Tx done callback. ctx points to route entry for ON requests, NULL for OFF.
+ */
+static void route_tx_done(void *ctx, hal_ln_result_t res)
+{
+    const ln_route_entry_t *e = ctx;
+
+    inflight--;
+    if (res != HAL_LN_SUCCESS)
+    {
+        route_res = HAL_LN_FAIL;
+        if (e)
+        {
+            sw_set(e->adr, e->dir, false);
+
+            // Cancel the OFF paired with this ON, if not sent yet
+            for (uint8_t i = 0; i < off_cnt; i++)
+            {
+                route_off_t    *o = &off[(off_head + i) % LN_ROUTE_OFF_CNT];
+
+                if (o->on == e)
+                {
+                    o->cancel = true;
+                    break;
+                }
+            }
+        }
+    }
+}
+
+int8_t ln_route_set(const ln_route_entry_t *entries, uint8_t cnt, hal_ln_tx_done_cb_t * cb, void *ctx)
+{
+    if (route)
+        return -1;
+
+    route_cnt = cnt;
+    route_idx = 0;
+    route_cb = cb;
+    route_ctx = ctx;
+    route_res = HAL_LN_SUCCESS;
+    route_next_on = hal_ln_time();
+    route = entries;
+
+    return 0;
+}
+
+bool ln_route_busy(void)
+{
+    return route != NULL;
+}
+
+void ln_route_update(void)
+{
+    uint16_t        now;
+
+    if (!route)
+        return;
+
+    hal_ln_wake_tick();         // Pending OFF and gap pacing are timed
+    now = hal_ln_time();
+
+    while (inflight < LN_ROUTE_INFLIGHT)
+    {
+        // Pending OFF takes precedence over next ON
+        if (off_cnt && (int16_t)(now - off[off_head].time) >= 0)
+        {
+            route_off_t    *o = &off[off_head];
+
+            if (!o->cancel)
+            {
+                if (ln_tx_opc_sw_req(o->adr, o->dir, false, route_tx_done, NULL))
+                    return;     // Out of packets, try again later
+                inflight++;
+            }
+            off_head = (off_head + 1) % LN_ROUTE_OFF_CNT;
+            off_cnt--;
+            continue;
+        }
+
+        // Skip turnouts that are already set
+        while (route_idx < route_cnt && sw_is(route[route_idx].adr, route[route_idx].dir))
+            route_idx++;
+
+        if (route_idx < route_cnt && off_cnt < LN_ROUTE_OFF_CNT && (int16_t)(now - route_next_on) >= 0)
+        {
+            const ln_route_entry_t *e = &route[route_idx];
+            route_off_t    *o = &off[(off_head + off_cnt) % LN_ROUTE_OFF_CNT];
+
+            if (ln_tx_opc_sw_req(e->adr, e->dir, true, route_tx_done, (void *)e))
+                return;         // Out of packets, try again later
+            inflight++;
+            route_idx++;
+            sw_set(e->adr, e->dir, true);
+            route_next_on = now + HAL_LN_MS(LN_ROUTE_GAP_MS);
+            o->adr = e->adr;
+            o->dir = e->dir;
+            o->cancel = false;
+            o->on = e;
+            o->time = now + HAL_LN_MS(LN_ROUTE_ON_MS);
+            off_cnt++;
+            continue;
+        }
+
+        break;
+    }
+
+    if (route_idx >= route_cnt && off_cnt == 0 && inflight == 0)
+    {
+        // Route done
+        route = NULL;
+        if (route_cb)
+            route_cb(route_ctx, route_res);
+    }
+}
@@ -0,0 +1,69 @@
+/*
+ * ln_route.h
+ */
+
+#ifndef LN_ROUTE_H_
+#define LN_ROUTE_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "hal_ln.h"
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+/**
+ * Route entry. One turnout and its wanted direction.
+ */
+typedef struct
+{
+    uint16_t        adr;
+    bool            dir;
+} ln_route_entry_t;
+
+/**
+ * Start setting a route.
+ *
+ * Each turnout in the route gets an OPC_SW_REQ ON, followed by an
+ * OPC_SW_REQ OFF after LN_ROUTE_ON_MS. Turnouts already known to be
+ * in the wanted direction are skipped.
+ * Only one route can be active at a time.
+ *
+ * @param entries Array of route entries. Must stay valid until route is done.
+ * @param cnt     Number of route entries.
+ * @param cb      Callback function for route done notification.
+ *                Result is HAL_LN_FAIL if one or more requests failed.
+ *                Set to NULL if not used.
+ * @param ctx     Pointer to context data, that will be passed on to
+ *                the callback function.
+ * @return        0 if route is started, -1 if another route is active.
+ */
+extern int8_t   ln_route_set(const ln_route_entry_t *entries, uint8_t cnt, hal_ln_tx_done_cb_t * cb, void *ctx);
+
+/**
+ * Check if a route is active.
+ */
+extern bool     ln_route_busy(void);
+
+/**
+ * Update turnout state known by route handling.
+ *
+ * Call this when turnout state is seen on LocoNet (e.g. from
+ * ln_rx_opc_sw_req), so redundant requests can be skipped.
+ */
+extern void     ln_route_sw_state(uint16_t adr, bool dir);
+
+/**
+ * Forget all known turnout states.
+ */
+extern void     ln_route_forget(void);
+
+extern void     ln_route_update(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* LN_ROUTE_H_ */
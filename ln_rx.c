@@ -6,11 +6,27 @@
  */
 
 #include <avr/pgmspace.h>
+#include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include "hal_ln.h"
 #include "ln_def.h"
 #include "ln_rx.h"
+#ifdef LNSTATREMOTE
+#include "ln_stat.h"
+#endif
+#ifdef LNINTERROGATE
+#include "ln_input.h"
+#endif
+#ifdef LNPROG
+#include "ln_prog.h"
+#endif
+
+/*
+ * Switch addresses used by command stations for interrogation.
+ */
+#define IQ_ADR_FIRST    1017
+#define IQ_ADR_LAST     1020
 
 
 #ifdef LNMONITOR
@@ -74,18 +90,134 @@ static const __flash char *opc_name(uint8_t opc)
 #endif
 
 
+#ifdef LNRXDUP
+
+/**
+ * Number of opcode/address (or slot) keys remembered for duplicate check.
+ */
+#ifndef LNRXDUP_CNT
+#define LNRXDUP_CNT     8
+#endif
+
+/**
+ * Time in ms an identical packet is considered a duplicate.
+ */
+#ifndef LNRXDUP_MS
+#define LNRXDUP_MS      250
+#endif
+
+typedef struct
+{
+    uint8_t         data[3];    // Op and data bytes (no checksum). Op 0 if unused
+    uint16_t        time;
+} dup_t;
+
+static dup_t    dup_window[LNRXDUP_CNT];
+static uint8_t  dup_idx;
+static ln_rx_dup_stat_t dup_stat;
+
+
+/*
+ * Check if packet has the same key as remembered packet.
+ * Key is opcode and slot (OPC_LOCO_xxx) or opcode and address (OPC_SW_REQ).
+ */
+static bool dup_key(const dup_t *d, const lnpacket_t *p)
+{
+    if (d->data[0] != p->raw[0] || d->data[1] != p->raw[1])
+        return false;
+    if (p->hdr.op == OPC_SW_REQ)
+        return (d->data[2] & 0x0f) == (p->raw[2] & 0x0f);
+    return true;
+}
+
+/*
+ * Check if packet is a repeat of the last packet with the same key.
+ * Only done for opcodes that are commonly repeated.
+ * A packet that differs from the last one with its key is never a duplicate
+ * (e.g. speed A, B, A), and replaces it.
+ */
+static bool dup_check(const lnpacket_t *p)
+{
+    dup_t          *d = NULL;
+    uint16_t        now;
+
+    switch (p->hdr.op)
+    {
+    case OPC_LOCO_SPD:
+    case OPC_LOCO_DIRF:
+    case OPC_LOCO_SND:
+    case OPC_SW_REQ:
+        break;
+    default:
+        return false;
+    }
+
+    now = hal_ln_time();
+    dup_stat.checked++;
+
+    for (uint8_t i = 0; i < LNRXDUP_CNT; i++)
+    {
+        if (dup_key(&dup_window[i], p))
+        {
+            d = &dup_window[i];
+            break;
+        }
+    }
+
+    if (d)
+    {
+        if (d->data[2] == p->raw[2] && (uint16_t)(now - d->time) < HAL_LN_MS(LNRXDUP_MS))
+        {
+            dup_stat.dropped++;
+            return true;
+        }
+    }
+    else
+    {
+        // New key: Replace oldest entry
+        d = &dup_window[dup_idx];
+        if (++dup_idx >= LNRXDUP_CNT)
+            dup_idx = 0;
+    }
+
+    d->data[0] = p->raw[0];
+    d->data[1] = p->raw[1];
+    d->data[2] = p->raw[2];
+    d->time = now;
+
+    return false;
+}
+
+void ln_rx_dup_stat(ln_rx_dup_stat_t *stat, bool reset)
+{
+    if (stat)
+        *stat = dup_stat;
+    if (reset)
+    {
+        dup_stat.checked = 0;
+        dup_stat.dropped = 0;
+    }
+}
+
+#endif
+
+
 void ln_rx_init(void)
 {
+#ifdef LNRXDUP
+    // Start with all entries unused
+    for (uint8_t i = 0; i < LNRXDUP_CNT; i++)
+        dup_window[i].data[0] = 0;
+#endif
 }
 
-void ln_rx_update(void)
+/*
+ * Decode received packet and call handler for its opcode.
+ */
+static void rx_dispatch(lnpacket_t *p)
 {
-    lnpacket_t     *p = hal_ln_receive();
     uint16_t        adr;
 
-    if (!p)
-        return;
-
 #ifdef LNMONITOR
     const uint8_t  *data = p->raw;
     uint8_t         len = hal_ln_packet_len(p);
@@ -96,11 +228,27 @@ void ln_rx_update(void)
     printf_P(PSTR("\n"));
 #endif
 
+#ifdef LNRXDUP
+    if (dup_check(p))
+    {
+#ifdef LNMONITOR
+        printf_P(PSTR("  duplicate\n"));
+#endif
+        ln_rx_duplicate(p);
+        hal_ln_packet_free(p);
+        return;
+    }
+#endif
+
     adr = (p->adr.adrl | (p->adr.adrh << 7)) + 1;
 
     switch (p->hdr.op)
     {
     case OPC_SW_REQ:
+#ifdef LNINTERROGATE
+        if (adr >= IQ_ADR_FIRST && adr <= IQ_ADR_LAST)
+            ln_input_interrogate();
+#endif
         ln_rx_opc_sw_req(adr, p->sw.dir, p->sw.on);
         break;
 
@@ -117,6 +265,10 @@ void ln_rx_update(void)
         break;
 
     case OPC_LONG_ACK:
+#ifdef LNPROG
+        if (ln_prog_rx(p))
+            break;
+#endif
         ln_rx_opc_long_ack(p->long_ack.lopc, p->long_ack.ack1);
         break;
 
@@ -128,6 +280,20 @@ void ln_rx_update(void)
         ln_rx_opc_sw_ack(adr, p->sw.dir, p->sw.on);
         break;
 
+#ifdef LNPROG
+    case OPC_SL_RD_DATA:
+        if (!ln_prog_rx(p))
+            ln_rx_opc_unknown(p);
+        break;
+#endif
+
+#ifdef LNSTATREMOTE
+    case OPC_PEER_XFER:
+        if (!ln_stat_rx(p))
+            ln_rx_opc_unknown(p);
+        break;
+#endif
+
         // Still missing more OPC's here
 
     default:
@@ -138,6 +304,22 @@ void ln_rx_update(void)
     hal_ln_packet_free(p);
 }
 
+void ln_rx_update(void)
+{
+    lnpacket_t     *p = hal_ln_receive();
+
+    if (!p)
+        return;
+
+#ifdef LNCYCLES
+    hal_ln_cycles_begin();
+    rx_dispatch(p);
+    hal_ln_cycles_end(HAL_LN_CYC_DISPATCH);
+#else
+    rx_dispatch(p);
+#endif
+}
+
 
 __attribute__((weak))
 void ln_rx_opc_sw_req(uint16_t adr, uint8_t dir, uint8_t on)
@@ -199,3 +381,10 @@ __attribute__((weak))
 void ln_rx_opc_unknown(const lnpacket_t *p)
 {
 }
+
+#ifdef LNRXDUP
+__attribute__((weak))
+void ln_rx_duplicate(const lnpacket_t *p)
+{
+}
+#endif
@@ -8,8 +8,22 @@
 #ifndef LN_RX_H_
 #define LN_RX_H_
 
+#include <stdbool.h>
 #include <stdint.h>
 
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+#ifdef LNRXDUP
+typedef struct
+{
+    uint16_t        checked;    // Packets checked for duplicates
+    uint16_t        dropped;    // Duplicates not dispatched
+} ln_rx_dup_stat_t;
+#endif
+
 extern void     ln_rx_init(void);
 extern void     ln_rx_update(void);
 
@@ -22,4 +36,13 @@ extern void     ln_rx_opc_sw_ack(uint16_t adr, uint8_t dir, uint8_t on);
 
 extern void     ln_rx_opc_unknown(const lnpacket_t *p);
 
+#ifdef LNRXDUP
+extern void     ln_rx_duplicate(const lnpacket_t *p);
+extern void     ln_rx_dup_stat(ln_rx_dup_stat_t *stat, bool reset);
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
 #endif /* LN_RX_H_ */
@@ -0,0 +1,287 @@
+/*
+ * ln_stat.c
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include "hal_ln.h"
+#include "ln_def.h"
+#include "ln_stat.h"
+
+/*
+ * Remote statistics over OPC_PEER_XFER.
+ *
+ * Request: SRC=LN_STAT_SRC, DST=node address, D1=STAT_REQ, D2=page.
+ * Reply:   SRC=LN_STAT_SRC, DST=node address, D1=STAT_REP, D2=page,
+ *          D3-D8=three values of the snapshot (LSB first).
+ * A request for page 0 takes a new snapshot. Other pages are answered from
+ * the stored snapshot, so a retried or late request gets the same values.
+ */
+
+#ifndef LNSTAT
+#error "ln_stat requires LNSTAT"
+#endif
+
+/**
+ * PEER_XFER SRC used for statistics requests and replies.
+ */
+#ifndef LN_STAT_SRC
+#define LN_STAT_SRC     0x53
+#endif
+
+/**
+ * Minimum time between two requests from collector (ms).
+ */
+#ifndef LN_STAT_GAP_MS
+#define LN_STAT_GAP_MS  50
+#endif
+
+/**
+ * Time to wait for a reply (ms).
+ */
+#ifndef LN_STAT_TIMEOUT_MS
+#define LN_STAT_TIMEOUT_MS  200
+#endif
+
+#define STAT_REQ        0x01
+#define STAT_REP        0x02
+
+#define PAGE_VALS       3
+#define PAGE_CNT        ((LN_STAT_VAL_CNT + PAGE_VALS - 1) / PAGE_VALS)
+
+#define PEER_XFER_LEN   16
+
+
+static uint16_t own_adr;
+static uint16_t snap[PAGE_CNT * PAGE_VALS];
+
+static const uint16_t *col_adr;
+static uint8_t  col_cnt;
+static uint8_t  col_idx;
+static uint8_t  col_page;
+static bool     col_wait;
+static uint16_t col_time;
+static ln_stat_cb_t *col_cb;
+static uint16_t col_vals[PAGE_CNT * PAGE_VALS];
+
+
+/*
+ * Send PEER_XFER with 8 data bytes.
+ */
+static bool xfer_send(uint16_t dst, const uint8_t *d)
+{
+    lnpacket_t     *p = hal_ln_packet_get();
+
+    if (!p)
+        return false;
+
+    p->raw[0] = OPC_PEER_XFER;
+    p->raw[1] = PEER_XFER_LEN;
+    p->raw[2] = LN_STAT_SRC;
+    p->raw[3] = dst & 0x7f;
+    p->raw[4] = (dst >> 7) & 0x7f;
+    p->raw[5] = 0;
+    p->raw[10] = 0;
+    for (uint8_t i = 0; i < 8; i++)
+    {
+        uint8_t         pos = (i < 4) ? 6 + i : 7 + i;
+        uint8_t         pxct = (i < 4) ? 5 : 10;
+
+        p->raw[pos] = d[i] & 0x7f;
+        if (d[i] & 0x80)
+            p->raw[pxct] |= 1 << (i & 0x03);
+    }
+    hal_ln_send(p, NULL, NULL);
+
+    return true;
+}
+
+/*
+ * Get 8 data bytes from PEER_XFER.
+ */
+static void xfer_data(const lnpacket_t *p, uint8_t *d)
+{
+    for (uint8_t i = 0; i < 8; i++)
+    {
+        uint8_t         pos = (i < 4) ? 6 + i : 7 + i;
+        uint8_t         pxct = (i < 4) ? 5 : 10;
+
+        d[i] = p->raw[pos];
+        if (p->raw[pxct] & (1 << (i & 0x03)))
+            d[i] |= 0x80;
+    }
+}
+
+/*
+ * Take snapshot of statistics and queue depths.
+ */
+static void stat_snapshot(uint16_t *vals)
+{
+    hal_ln_stat_t   s;
+    hal_ln_queues_t q;
+
+    hal_ln_stat_get(&s, false);
+    hal_ln_queues(&q);
+
+    vals[LN_STAT_TX_TOTAL] = s.tx_total;
+    vals[LN_STAT_TX_SUCCESS] = s.tx_success;
+    vals[LN_STAT_TX_FAIL] = s.tx_fail;
+    vals[LN_STAT_TX_COLLISIONS] = s.tx_collisions;
+    vals[LN_STAT_TX_ECHO_ERR] = s.tx_echo_err;
+    vals[LN_STAT_TX_MAX_ATTEMPTS] = s.tx_max_attempts;
+    vals[LN_STAT_RX_SUCCESS] = s.rx_success;
+    vals[LN_STAT_RX_SUCCESS_LARGE] = s.rx_success_large;
+    vals[LN_STAT_RX_CHECKSUM] = s.rx_checksum;
+    vals[LN_STAT_RX_PARTIAL] = s.rx_partial;
+    vals[LN_STAT_RX_EXTRADATA] = s.rx_extradata;
+    vals[LN_STAT_RX_COLLISIONS] = s.rx_collisions;
+    vals[LN_STAT_RX_FERR_ZERO] = s.rx_ferr_zero;
+    vals[LN_STAT_RX_TIMEOUT] = s.rx_timeout;
+    vals[LN_STAT_RX_NOMEM] = s.rx_nomem;
+    vals[LN_STAT_RX_QUOTA] = s.rx_quota;
+    vals[LN_STAT_RX_SCRATCH] = s.rx_scratch;
+    vals[LN_STAT_POOL_DENIED] = s.pool_denied;
+    vals[LN_STAT_TX_STALL] = s.tx_stall;
+    vals[LN_STAT_RX_OVERRUN] = s.rx_overrun;
+#ifdef LNBUSMON
+    vals[LN_STAT_BUS_STATE] = hal_ln_bus_state();
+#else
+    vals[LN_STAT_BUS_STATE] = 0;
+#endif
+    vals[LN_STAT_Q_FREE_TX] = q.free | (q.tx << 8);
+    vals[LN_STAT_Q_RX_DONE] = q.rx | (q.done << 8);
+}
+
+/*
+ * Answer request for one page of the snapshot.
+ */
+static void stat_reply(uint8_t page)
+{
+    uint8_t         d[8];
+
+    if (page >= PAGE_CNT)
+        return;
+
+    if (page == 0)
+        stat_snapshot(snap);
+
+    d[0] = STAT_REP;
+    d[1] = page;
+    for (uint8_t i = 0; i < PAGE_VALS; i++)
+    {
+        d[2 + 2 * i] = snap[page * PAGE_VALS + i];
+        d[3 + 2 * i] = snap[page * PAGE_VALS + i] >> 8;
+    }
+    xfer_send(own_adr, d);
+}
+
+/*
+ * Next node in collection.
+ */
+static void col_next(void)
+{
+    col_page = 0;
+    col_wait = false;
+    if (++col_idx >= col_cnt)
+        col_cb = NULL;          // Done
+}
+
+void ln_stat_init(uint16_t adr)
+{
+    own_adr = adr;
+}
+
+bool ln_stat_rx(const lnpacket_t *p)
+{
+    uint8_t         d[8];
+    uint16_t        dst;
+
+    if (p->hdr.op != OPC_PEER_XFER || p->hdr.len != PEER_XFER_LEN || p->raw[2] != LN_STAT_SRC)
+        return false;
+
+    dst = p->raw[3] | (p->raw[4] << 7);
+    xfer_data(p, d);
+
+    if (d[0] == STAT_REQ)
+    {
+        if (own_adr && dst == own_adr)
+            stat_reply(d[1]);
+        return true;
+    }
+
+    if (d[0] == STAT_REP)
+    {
+        if (col_cb && col_wait && dst == col_adr[col_idx] && d[1] == col_page)
+        {
+            for (uint8_t i = 0; i < PAGE_VALS; i++)
+                col_vals[col_page * PAGE_VALS + i] = d[2 + 2 * i] | (d[3 + 2 * i] << 8);
+            col_wait = false;
+            if (++col_page >= PAGE_CNT)
+            {
+                col_cb(dst, col_vals);
+                col_next();
+            }
+        }
+        return true;
+    }
+
+    return false;
+}
+
+int8_t ln_stat_collect(const uint16_t *adr, uint8_t cnt, ln_stat_cb_t * cb)
+{
+    if (col_cb)
+        return -1;
+    if (!cnt || !cb)
+        return 0;
+
+    col_adr = adr;
+    col_cnt = cnt;
+    col_idx = 0;
+    col_page = 0;
+    col_wait = false;
+    col_time = hal_ln_time() - HAL_LN_MS(LN_STAT_GAP_MS);
+    col_cb = cb;
+
+    return 0;
+}
+
+bool ln_stat_busy(void)
+{
+    return col_cb != NULL;
+}
+
+void ln_stat_update(void)
+{
+    uint16_t        now = hal_ln_time();
+
+    if (!col_cb)
+        return;
+
+    hal_ln_wake_tick();         // Request pacing and reply timeout
+
+    if (col_wait)
+    {
+        if ((uint16_t)(now - col_time) < HAL_LN_MS(LN_STAT_TIMEOUT_MS))
+            return;
+
+        // No reply, give up on this node
+        col_cb(col_adr[col_idx], NULL);
+        col_next();
+        col_time = now;
+        return;
+    }
+
+    if ((uint16_t)(now - col_time) < HAL_LN_MS(LN_STAT_GAP_MS))
+        return;
+
+    uint8_t         d[8] = { STAT_REQ, col_page };
+
+    if (xfer_send(col_adr[col_idx], d))
+    {
+        col_wait = true;
+        col_time = now;
+    }
+}
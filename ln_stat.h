@@ -0,0 +1,103 @@
+/*
+ * ln_stat.h
+ */
+
+#ifndef LN_STAT_H_
+#define LN_STAT_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "hal_ln.h"
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+/**
+ * Values in a remote statistics snapshot.
+ * The snapshot is taken when page 0 is requested, so all pages of one poll
+ * are from the same moment.
+ */
+enum
+{
+    LN_STAT_TX_TOTAL,
+    LN_STAT_TX_SUCCESS,
+    LN_STAT_TX_FAIL,
+    LN_STAT_TX_COLLISIONS,
+    LN_STAT_TX_ECHO_ERR,
+    LN_STAT_TX_MAX_ATTEMPTS,
+    LN_STAT_RX_SUCCESS,
+    LN_STAT_RX_SUCCESS_LARGE,
+    LN_STAT_RX_CHECKSUM,
+    LN_STAT_RX_PARTIAL,
+    LN_STAT_RX_EXTRADATA,
+    LN_STAT_RX_COLLISIONS,
+    LN_STAT_RX_FERR_ZERO,
+    LN_STAT_RX_TIMEOUT,
+    LN_STAT_RX_NOMEM,
+    LN_STAT_RX_QUOTA,
+    LN_STAT_RX_SCRATCH,
+    LN_STAT_POOL_DENIED,
+    LN_STAT_TX_STALL,
+    LN_STAT_RX_OVERRUN,
+    LN_STAT_BUS_STATE,          // HAL_LN_BUS_xxx flags (0 without LNBUSMON)
+    LN_STAT_Q_FREE_TX,          // Free packets (LSB), tx queue (MSB)
+    LN_STAT_Q_RX_DONE,          // Rx queue (LSB), done queue (MSB)
+    LN_STAT_VAL_CNT
+};
+
+/**
+ * Callback type for collected node statistics.
+ *
+ * @param adr  Node address.
+ * @param vals Statistics (LN_STAT_VAL_CNT values), or NULL if node didn't answer.
+ */
+typedef void    (ln_stat_cb_t) (uint16_t adr, const uint16_t *vals);
+
+/**
+ * Init remote statistics.
+ *
+ * @param adr Address of this node (1-16383). Requests for this address are answered.
+ */
+extern void     ln_stat_init(uint16_t adr);
+
+/**
+ * Handle received OPC_PEER_XFER.
+ *
+ * Called from ln_rx_update if LNSTATREMOTE is defined.
+ *
+ * @param p Received LocoNet packet.
+ * @return  true if packet was a statistics request or reply.
+ */
+extern bool     ln_stat_rx(const lnpacket_t *p);
+
+/**
+ * Collect statistics from a list of nodes.
+ *
+ * Nodes are polled one request at a time, paced by LN_STAT_GAP_MS.
+ *
+ * @param adr Array of node addresses. Must stay valid until collection is done.
+ * @param cnt Number of node addresses.
+ * @param cb  Called once for each node.
+ * @return    0 if started, -1 if a collection is already running.
+ */
+extern int8_t   ln_stat_collect(const uint16_t *adr, uint8_t cnt, ln_stat_cb_t * cb);
+
+/**
+ * Check if a collection is running.
+ */
+extern bool     ln_stat_busy(void);
+
+/**
+ * Update remote statistics collection.
+ *
+ * Call regularly from mainloop.
+ */
+extern void     ln_stat_update(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* LN_STAT_H_ */
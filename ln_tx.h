@@ -12,6 +12,11 @@
 #include <stdint.h>
 #include "hal_ln.h"
 
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
 extern int8_t   ln_tx_opc_sw_req(uint16_t adr, bool dir, bool on, hal_ln_tx_done_cb_t * cb, void *ctx);
 extern int8_t   ln_tx_opc_sw_state(uint16_t adr, bool dir, bool on, hal_ln_tx_done_cb_t * cb, void *ctx);
 extern int8_t   ln_tx_opc_sw_ack(uint16_t adr, bool dir, bool on, hal_ln_tx_done_cb_t * cb, void *ctx);
@@ -20,4 +25,8 @@ extern int8_t   ln_tx_opc_sw_rep_input(uint16_t adr, bool l, bool i, hal_ln_tx_d
 extern int8_t   ln_tx_opc_sw_rep_output(uint16_t adr, bool t, bool c, hal_ln_tx_done_cb_t * cb, void *ctx);
 extern int8_t   ln_tx_opc_long_ack(uint8_t lopc, uint8_t ack1, hal_ln_tx_done_cb_t * cb, void *ctx);
 
+#ifdef __cplusplus
+}
+#endif
+
 #endif /* LN_TX_H_ */
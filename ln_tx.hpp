@@ -0,0 +1,171 @@
+/*
+ * ln_tx.hpp
+ */
+
+#ifndef LN_TX_HPP_
+#define LN_TX_HPP_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include "hal_ln.h"
+#include "ln_def.h"
+
+#if __cplusplus < 201402L
+#error "ln_tx.hpp requires C++14 or later"
+#endif
+
+/*
+ * C++ (C++14 or later) LocoNet packet builders.
+ *
+ * Builders are constexpr, so packets with constant parameters are encoded
+ * and checksummed by the compiler, e.g.
+ *   constexpr auto p = ln::sw_req(12, true, true);
+ *   ln::send(p);
+ * Builders can also be called with runtime parameters. The packet is sent
+ * with hal_ln_send_prepared, that skips masking and checksum calculation.
+ */
+namespace ln
+{
+
+/*
+ * Fixed length LocoNet packet, including checksum.
+ */
+template < uint8_t N > struct packet
+{
+    static_assert(N >= 2 && N <= LNPACKET_SIZE_MAX, "Invalid LocoNet packet length");
+    uint8_t         raw[N];
+};
+
+/*
+ * Add checksum to packet.
+ */
+template < uint8_t N > constexpr packet < N > cksum(packet < N > p)
+{
+    uint8_t         c = 0xff;
+
+    for (uint8_t i = 0; i < N - 1; i++)
+        c ^= p.raw[i];
+    p.raw[N - 1] = c;
+
+    return p;
+}
+
+/*
+ * 2-byte packet (op only).
+ */
+constexpr packet < 2 > op2(uint8_t op)
+{
+    return cksum(packet < 2 > {{op, 0}});
+}
+
+/*
+ * 4-byte packet.
+ */
+constexpr packet < 4 > op4(uint8_t op, uint8_t b1, uint8_t b2)
+{
+    return cksum(packet < 4 > {{op, (uint8_t) (b1 & 0x7f), (uint8_t) (b2 & 0x7f), 0}});
+}
+
+constexpr packet < 2 > gpon()
+{
+    return op2(OPC_GPON);
+}
+
+constexpr packet < 2 > gpoff()
+{
+    return op2(OPC_GPOFF);
+}
+
+constexpr packet < 2 > idle()
+{
+    return op2(OPC_IDLE);
+}
+
+/*
+ * OPC_SW_REQ, OPC_SW_STATE and OPC_SW_ACK. Same parameters as ln_tx_opc_sw_xxx.
+ */
+constexpr packet < 4 > sw(uint8_t op, uint16_t adr, bool dir, bool on)
+{
+    return op4(op, (adr - 1) & 0x7f, (((adr - 1) >> 7) & 0x0f) | (on ? 0x10 : 0) | (dir ? 0x20 : 0));
+}
+
+constexpr packet < 4 > sw_req(uint16_t adr, bool dir, bool on)
+{
+    return sw(OPC_SW_REQ, adr, dir, on);
+}
+
+constexpr packet < 4 > sw_state(uint16_t adr, bool dir, bool on)
+{
+    return sw(OPC_SW_STATE, adr, dir, on);
+}
+
+constexpr packet < 4 > sw_ack(uint16_t adr, bool dir, bool on)
+{
+    return sw(OPC_SW_ACK, adr, dir, on);
+}
+
+/*
+ * OPC_INPUT_REP. Same parameters as ln_tx_opc_input_rep.
+ */
+constexpr packet < 4 > input_rep(uint16_t adr, bool l)
+{
+    return op4(OPC_INPUT_REP, ((adr - 1) >> 1) & 0x7f,
+               (((adr - 1) >> 8) & 0x0f) | (l ? 0x10 : 0) | (((adr - 1) & 0x01) << 5) | 0x40);
+}
+
+/*
+ * OPC_SW_REP. Same parameters as ln_tx_opc_sw_rep_xxx.
+ */
+constexpr packet < 4 > sw_rep_input(uint16_t adr, bool l, bool i)
+{
+    return op4(OPC_SW_REP, (adr - 1) & 0x7f,
+               (((adr - 1) >> 7) & 0x0f) | (l ? 0x10 : 0) | (i ? 0x20 : 0) | 0x40);
+}
+
+constexpr packet < 4 > sw_rep_output(uint16_t adr, bool t, bool c)
+{
+    return op4(OPC_SW_REP, (adr - 1) & 0x7f, (((adr - 1) >> 7) & 0x0f) | (t ? 0x10 : 0) | (c ? 0x20 : 0));
+}
+
+/*
+ * OPC_LONG_ACK. Same parameters as ln_tx_opc_long_ack.
+ */
+constexpr packet < 4 > long_ack(uint8_t lopc, uint8_t ack1)
+{
+    return op4(OPC_LONG_ACK, lopc, ack1);
+}
+
+/*
+ * OPC_RQ_SL_DATA.
+ */
+constexpr packet < 4 > rq_sl_data(uint8_t slot)
+{
+    return op4(OPC_RQ_SL_DATA, slot, 0);
+}
+
+/*
+ * Send packet. Returns 0 on success, -1 if no LocoNet packet is available
+ * (same as ln_tx_opc_xxx).
+ */
+template < uint8_t N > inline int8_t send(const packet < N > &p, hal_ln_tx_done_cb_t * cb = NULL, void *ctx = NULL)
+{
+    lnpacket_t     *lp = hal_ln_packet_get();
+
+    if (!lp)
+        return -1;
+
+    memcpy(lp->raw, p.raw, N);
+    hal_ln_send_prepared(lp, cb, ctx);
+
+    return 0;
+}
+
+/*
+ * Encoding checks (OPC_SW_REQ for turnout 1, closed, on).
+ */
+static_assert(sw_req(1, true, true).raw[2] == 0x30 && sw_req(1, true, true).raw[3] == 0x7f, "sw_req encoding");
+
+}
+
+#endif /* LN_TX_HPP_ */
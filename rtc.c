@@ -0,0 +1,30 @@
+/*
+ * rtc.c
+ */
+
+#include <avr/io.h>
+#include "hal_ln.h"
+#include "rtc.h"
+
+#if HAL_LN_TICK_HZ != 32768 / 32
+#error "HAL_LN_TICK_HZ does not match RTC prescaler"
+#endif
+
+void rtc_init(void)
+{
+    // RTC used as free running time base for the library
+    // 32.768 kHz internal oscillator / 32 = 1024 Hz
+    while (RTC.STATUS)
+        ;
+    RTC.CLKSEL = RTC_CLKSEL_OSC32K_gc;
+    RTC.PER = 0xffff;
+    RTC.INTCTRL = 0;            // No overflow/compare interrupts
+    RTC.CTRLA = RTC_PRESCALER_DIV32_gc | RTC_RUNSTDBY_bm | RTC_RTCEN_bm;
+
+    // PIT every 512 / 32.768 kHz = 15.6 ms. Interrupt is enabled by hal_ln
+    // while transmitting (tx stall supervision)
+    while (RTC.PITSTATUS)
+        ;
+    RTC.PITINTCTRL = 0;
+    RTC.PITCTRLA = RTC_PERIOD_CYC512_gc | RTC_PITEN_bm;
+}
@@ -0,0 +1,38 @@
+/*
+ * rtc.h
+ */
+
+
+#ifndef RTC_H_
+#define RTC_H_
+
+#include <avr/io.h>
+#include <stdint.h>
+#include <util/atomic.h>
+
+/**
+ * Get RTC counter.
+ *
+ * Free running, counts at HAL_LN_TICK_HZ and wraps around at 0xffff.
+ */
+__attribute__((always_inline))
+static inline uint16_t rtc_cnt(void)
+{
+    uint16_t        cnt;
+
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+    {
+        cnt = RTC.CNT;
+    }
+    return cnt;
+}
+
+/**
+ * Init RTC.
+ *
+ * Call once before interrupts are enabled.
+ * NOTE: Handled from hal_ln.c
+ */
+extern void     rtc_init(void);
+
+#endif /* RTC_H_ */
@@ -0,0 +1,78 @@
+/*
+ * timing.h
+ */
+
+
+#ifndef TIMING_H_
+#define TIMING_H_
+
+#include <stdint.h>
+#include "ccl.h"
+
+/*
+ * All LocoNet timing is derived from F_CPU at compile time.
+ * The values are checked here, so an unsupported clock speed gives a
+ * compile error instead of a node that misbehaves on the bus.
+ */
+
+#ifndef F_CPU
+#error "F_CPU must be defined"
+#endif
+
+/**
+ * LocoNet baudrate.
+ */
+#define BAUDRATE        16667UL
+
+/**
+ * USART baudrate register value (normal speed, rounded).
+ */
+#define BAUD_REG        ((64 * F_CPU + 8 * BAUDRATE) / (16 * BAUDRATE))
+
+/**
+ * Deviation of actual baudrate from BAUDRATE in ppm.
+ */
+#define BAUD_ERR_PPM    ((int32_t)((64ULL * F_CPU * 1000000ULL + 8ULL * BAUD_REG * BAUDRATE) / (16ULL * BAUD_REG * BAUDRATE)) - 1000000L)
+
+/**
+ * Max allowed baudrate deviation in ppm.
+ */
+#define BAUD_TOL_PPM    10000L
+
+/**
+ * Collision detector filter. TCB0 timeout of 15 us (1/4 bit).
+ */
+#define TCB0_CCMP_VAL   (F_CPU * 15 / 1000000UL)
+
+/**
+ * BREAK length. TCB1 single-shot of 15 bits (60 us each).
+ */
+#define TCB1_CCMP_VAL   ((F_CPU * 60 / 1000000UL) * 15)
+
+/**
+ * CD BACKOFF tick. TCA0 period of CD_TICK_TIME us.
+ */
+#define TCA0_PER_VAL    (F_CPU * CD_TICK_TIME / 1000000UL - 1)
+
+/**
+ * Deviation in ppm of cnt clock cycles from us microseconds.
+ */
+#define TIME_ERR_PPM(cnt, us) ((int32_t)((uint64_t)(cnt) * 1000000ULL * 1000000ULL / ((uint64_t)F_CPU * (us))) - 1000000L)
+
+/**
+ * Max allowed deviation of derived bit times in ppm.
+ */
+#define BIT_TOL_PPM     20000L
+
+#define ABS_(x)         ((x) < 0 ? -(x) : (x))
+
+_Static_assert(BAUD_REG >= 64 && BAUD_REG <= 0xffff, "F_CPU out of range for LocoNet baudrate");
+_Static_assert(ABS_(BAUD_ERR_PPM) <= BAUD_TOL_PPM, "LocoNet baudrate deviation too large at this F_CPU");
+_Static_assert(TCB0_CCMP_VAL >= 1 && TCB0_CCMP_VAL <= 0xffff, "F_CPU out of range for collision filter (TCB0)");
+_Static_assert(ABS_(TIME_ERR_PPM(TCB0_CCMP_VAL, 15)) <= BIT_TOL_PPM, "Collision filter time deviation too large at this F_CPU");
+_Static_assert(TCB1_CCMP_VAL <= 0xffff, "F_CPU out of range for BREAK timer (TCB1)");
+_Static_assert(ABS_(TIME_ERR_PPM(TCB1_CCMP_VAL, 60 * 15)) <= BIT_TOL_PPM, "BREAK time deviation too large at this F_CPU");
+_Static_assert(TCA0_PER_VAL >= 1 && TCA0_PER_VAL <= 0xffff, "F_CPU out of range for CD BACKOFF tick (TCA0)");
+_Static_assert(F_CPU % (1000000UL / CD_TICK_TIME) == 0, "F_CPU must be a multiple of 100 kHz for exact CD BACKOFF tick");
+
+#endif /* TIMING_H_ */
@@ -0,0 +1,77 @@
+#!/usr/bin/env python3
+#
+# lntrace.py
+#
+# Decode trace dump from shell cmd "ln x" (hal_ln.c with LNTRACE) into a timeline.
+#
+# Usage: lntrace.py [dumpfile]   (reads stdin if no file is given)
+#
+# Each record has an RTC tick (HAL_LN_TICK_HZ) and a cycle count (F_CPU,
+# wraps at 65536). The time between two records is the cycle difference,
+# with the number of cycle counter wraps taken from the RTC difference.
+# Gaps longer than approx. 40 ms are only as accurate as the RTC.
+
+import sys
+
+# Keep in sync with trace events in hal_ln.c
+EVENTS = {
+    1: ("TX_START", lambda a: "attempt %d" % a),
+    2: ("TX_BUSY", lambda a: "line busy"),
+    3: ("TX_ARM", lambda a: "backoff %d us" % (a * 20)),
+    4: ("TX_END", lambda a: {0: "ok", 1: "retry", 2: "fail", 3: "stalled"}.get(a, str(a))),
+    5: ("RX_OP", lambda a: "op 0x%02x" % a),
+    6: ("RX_END", lambda a: {0: "ok", 1: "checksum", 2: "too large", 3: "no memory"}.get(a, str(a))),
+    7: ("RX_FERR", lambda a: "data 0x%02x" % a),
+    8: ("Q_TX", lambda a: "op 0x%02x" % a),
+    9: ("Q_DONE", lambda a: "op 0x%02x" % a),
+    10: ("Q_RX", lambda a: "op 0x%02x" % a),
+    11: ("SCHED", lambda a: ""),
+    12: ("DONE_CB", lambda a: {0: "success", 1: "fail", 2: "timeout"}.get(a, str(a))),
+}
+
+
+def decode(lines):
+    f_cpu = None
+    tick_hz = None
+    prev = None
+    t = 0.0
+
+    for line in lines:
+        w = line.split()
+        if not w:
+            continue
+        if w[0] == "trace":
+            f_cpu, tick_hz = int(w[1]), int(w[2])
+            prev = None
+            t = 0.0
+            print("%12s %10s  %-9s %s" % ("time us", "delta us", "event", "arg"))
+            continue
+        if w[0] == "end" or f_cpu is None:
+            continue
+
+        ev, arg, tick, cyc = (int(x) for x in w[:4])
+        if prev is None:
+            delta = 0
+        else:
+            dtick = (tick - prev[0]) & 0xffff
+            dcyc = (cyc - prev[1]) & 0xffff
+            expected = dtick * f_cpu / tick_hz
+            delta = dcyc + 65536 * round((expected - dcyc) / 65536)
+        prev = (tick, cyc)
+
+        us = delta * 1e6 / f_cpu
+        t += us
+        name, fmt = EVENTS.get(ev, ("EV%d" % ev, lambda a: str(a)))
+        print("%12.1f %10.1f  %-9s %s" % (t, us, name, fmt(arg)))
+
+
+def main():
+    if len(sys.argv) > 1:
+        with open(sys.argv[1]) as f:
+            decode(f)
+    else:
+        decode(sys.stdin)
+
+
+if __name__ == "__main__":
+    main()